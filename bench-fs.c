@@ -0,0 +1,214 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fs.h>
+
+#define bench_fs_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)			\
+do {					\
+	bench_fs_error(__VA_ARGS__);	\
+	exit(1);			\
+} while (0)
+
+/* Every thread goes this many times over its whole file */
+#define BENCH_PASSES 4
+
+/* Defaults: size of the file of every thread, and of every I/O, in KiB */
+#define BENCH_FILE_KIB 1024
+#define BENCH_IO_KIB   16
+
+/* Overwrite or read the file of every thread, or append to new files */
+enum bench_mode {
+	BENCH_WRITE,
+	BENCH_READ,
+	BENCH_APPEND,
+};
+
+struct bench_arg {
+	int id;
+	size_t file_size;
+	size_t io_size;
+	enum bench_mode mode;
+	int errors;
+};
+
+/* The files appended to get the IDs after the ones of the threads */
+static char *bench_filename(int id)
+{
+	static char names[2 * FS_OPEN_MAX_COUNT][FS_FILENAME_LEN];
+
+	snprintf(names[id], FS_FILENAME_LEN, "bench.%u", (unsigned char)id);
+	return names[id];
+}
+
+/*
+ * Write or read the whole file of a thread, BENCH_PASSES times. Every pass
+ * writes its own byte pattern, and the reads check the pattern of the last
+ * write pass. In append mode, every pass creates a new file instead, so that
+ * all its blocks get allocated while measuring, and deletes it.
+ */
+static void *bench_thread(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	char *buf, *expected;
+	int fd;
+
+	buf = malloc(b_arg->io_size);
+	expected = malloc(b_arg->io_size);
+	if (!buf || !expected)
+		die("Cannot allocate buffers");
+	memset(expected, 'a' + (b_arg->id + BENCH_PASSES - 1) % 26,
+	       b_arg->io_size);
+
+	if (b_arg->mode == BENCH_APPEND) {
+		char *filename = bench_filename(FS_OPEN_MAX_COUNT + b_arg->id);
+
+		memset(buf, 'a' + b_arg->id % 26, b_arg->io_size);
+		for (int pass = 0; pass < BENCH_PASSES; pass++) {
+			if (fs_create(filename))
+				die("Cannot create file");
+			fd = fs_open(filename);
+			if (fd < 0)
+				die("Cannot open file");
+			for (size_t off = 0; off < b_arg->file_size; off += b_arg->io_size) {
+				if (fs_write(fd, buf, b_arg->io_size) != b_arg->io_size)
+					die("Short I/O at offset %zu", off);
+			}
+			if (fs_close(fd))
+				die("Cannot close file");
+			if (fs_delete(filename))
+				die("Cannot delete file");
+		}
+		goto out;
+	}
+
+	fd = fs_open(bench_filename(b_arg->id));
+	if (fd < 0)
+		die("Cannot open file");
+
+	for (int pass = 0; pass < BENCH_PASSES; pass++) {
+		if (fs_lseek(fd, 0))
+			die("Cannot seek file");
+		if (b_arg->mode == BENCH_WRITE)
+			memset(buf, 'a' + (b_arg->id + pass) % 26, b_arg->io_size);
+
+		for (size_t off = 0; off < b_arg->file_size; off += b_arg->io_size) {
+			int ret;
+			if (b_arg->mode == BENCH_WRITE) {
+				ret = fs_write(fd, buf, b_arg->io_size);
+			} else {
+				ret = fs_read(fd, buf, b_arg->io_size);
+				if (ret == b_arg->io_size &&
+				    memcmp(buf, expected, b_arg->io_size))
+					b_arg->errors++;
+			}
+			if (ret != b_arg->io_size)
+				die("Short I/O at offset %zu", off);
+		}
+	}
+
+	if (fs_close(fd))
+		die("Cannot close file");
+
+out:
+	free(buf);
+	free(expected);
+	return NULL;
+}
+
+/* Run one phase with @nthreads threads, return the throughput in MiB/s */
+static double bench_phase(int nthreads, size_t file_size, size_t io_size,
+			  enum bench_mode mode, int *errors)
+{
+	pthread_t threads[FS_OPEN_MAX_COUNT];
+	struct bench_arg args[FS_OPEN_MAX_COUNT];
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < nthreads; i++) {
+		args[i].id = i;
+		args[i].file_size = file_size;
+		args[i].io_size = io_size;
+		args[i].mode = mode;
+		args[i].errors = 0;
+		if (pthread_create(&threads[i], NULL, bench_thread, &args[i]))
+			die("Cannot create thread");
+	}
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+		*errors += args[i].errors;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	double mib = (double)nthreads * BENCH_PASSES * file_size / (1024 * 1024);
+	return mib / secs;
+}
+
+int main(int argc, char **argv)
+{
+	char *diskname;
+	int max_threads;
+	size_t file_size = BENCH_FILE_KIB * 1024;
+	size_t io_size = BENCH_IO_KIB * 1024;
+	int errors = 0;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <diskname> <max_threads> "
+			"[file_kib] [io_kib]\n", argv[0]);
+		exit(1);
+	}
+	diskname = argv[1];
+	max_threads = atoi(argv[2]);
+	if (argc > 3)
+		file_size = (size_t)atoi(argv[3]) * 1024;
+	if (argc > 4)
+		io_size = (size_t)atoi(argv[4]) * 1024;
+	if (max_threads <= 0 || max_threads > FS_OPEN_MAX_COUNT ||
+	    io_size == 0 || file_size % io_size)
+		die("Invalid parameters");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* One file per thread, allocated before measuring */
+	for (int i = 0; i < max_threads; i++) {
+		if (fs_create(bench_filename(i)))
+			die("Cannot create file");
+	}
+	bench_phase(max_threads, file_size, io_size, BENCH_WRITE, &errors);
+
+	printf("threads\twrite MiB/s\tread MiB/s\tappend MiB/s\n");
+	/* Powers of 2, and the maximum */
+	for (int n = 1; ; n *= 2) {
+		if (n > max_threads)
+			n = max_threads;
+		double write_rate = bench_phase(n, file_size, io_size,
+						BENCH_WRITE, &errors);
+		double read_rate = bench_phase(n, file_size, io_size,
+					       BENCH_READ, &errors);
+		double append_rate = bench_phase(n, file_size, io_size,
+						 BENCH_APPEND, &errors);
+		printf("%d\t%.1f\t\t%.1f\t\t%.1f\n", n, write_rate, read_rate,
+		       append_rate);
+		if (n == max_threads)
+			break;
+	}
+
+	for (int i = 0; i < max_threads; i++)
+		fs_delete(bench_filename(i));
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (errors)
+		die("%d reads returned unexpected data", errors);
+
+	return 0;
+}
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <uthread.h>
+
+#define bench_uthread_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {						\
+	bench_uthread_error(__VA_ARGS__);	\
+	exit(1);				\
+} while (0)
+
+/* Defaults: number of threads, and of yields of every thread */
+#define BENCH_THREADS 2
+#define BENCH_YIELDS  1000000
+
+static int num_threads = BENCH_THREADS;
+static long num_yields = BENCH_YIELDS;
+
+/* Yields of the background thread, until the interactive threads are done */
+static volatile long num_background_yields;
+static volatile long num_starved_yields = -1;
+static volatile int is_stopping;
+
+/* Every thread yields in a loop, so that every yield switches threads */
+static void bench_thread(void *arg)
+{
+	for (long i = 0; i < num_yields; i++)
+		uthread_yield();
+}
+
+static void bench_start(void *arg)
+{
+	uthread_t *tids = malloc(num_threads * sizeof(uthread_t));
+	if (tids == NULL)
+		die("Cannot allocate thread IDs");
+
+	for (int i = 0; i < num_threads; i++) {
+		tids[i] = uthread_create(bench_thread, NULL);
+		if (tids[i] == -1)
+			die("Cannot create thread");
+	}
+	for (int i = 0; i < num_threads; i++)
+		uthread_join(tids[i], NULL);
+	free(tids);
+}
+
+/* Background thread, yielding until stopped */
+static void bench_background(void *arg)
+{
+	uthread_set_class(UTHREAD_CLASS_BACKGROUND);
+	while (!is_stopping) {
+		uthread_yield();
+		num_background_yields++;
+	}
+}
+
+/* Interactive thread, the first one done records how far the background
+ * thread got */
+static void bench_interactive(void *arg)
+{
+	for (long i = 0; i < num_yields; i++)
+		uthread_yield();
+	if (num_starved_yields == -1)
+		num_starved_yields = num_background_yields;
+}
+
+/*
+ * Two interactive threads yield in a loop, while a background thread is
+ * ready all along: the background thread must still get some turns.
+ */
+static void bench_classes(void *arg)
+{
+	uthread_t tids[3];
+
+	tids[0] = uthread_create(bench_background, NULL);
+	if (tids[0] == -1)
+		die("Cannot create thread");
+	/* Let the background thread lower its class first */
+	uthread_yield();
+
+	uthread_set_class(UTHREAD_CLASS_INTERACTIVE);
+	for (int i = 1; i < 3; i++) {
+		tids[i] = uthread_create(bench_interactive, NULL);
+		if (tids[i] == -1)
+			die("Cannot create thread");
+	}
+	uthread_join(tids[1], NULL);
+	uthread_join(tids[2], NULL);
+	is_stopping = 1;
+	uthread_join(tids[0], NULL);
+}
+
+int main(int argc, char **argv)
+{
+	int num_workers = 1;
+	struct timespec start, end;
+
+	if (argc > 1)
+		num_threads = atoi(argv[1]);
+	if (argc > 2)
+		num_yields = atol(argv[2]);
+	if (argc > 3)
+		num_workers = atoi(argv[3]);
+	if (num_threads <= 0 || num_yields <= 0 || num_workers <= 0) {
+		fprintf(stderr, "Usage: %s [threads] [yields] [workers]\n",
+			argv[0]);
+		exit(1);
+	}
+
+	uthread_workers_config(num_workers);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	uthread_start(bench_start, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	double yields = (double)num_threads * num_yields;
+	printf("threads\tworkers\tyields/s\tns/yield\n");
+	printf("%d\t%d\t%.0f\t%.1f\n", num_threads, num_workers,
+	       yields / secs, secs * 1e9 / yields);
+
+	uthread_start(bench_classes, NULL);
+	printf("interactive yields\tbackground yields\n");
+	printf("%ld\t\t\t%ld\n", 2 * num_yields, num_starved_yields);
+	if (num_starved_yields <= 0)
+		die("Background thread starved by interactive threads");
+
+	return 0;
+}
@@ -1,16 +1,184 @@
+#include <pthread.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #define _UTHREAD_PRIVATE
 #include "context.h"
-//#include "preempt.h"
 #include "uthread.h"
 
-/* Size of the stack for a thread (in bytes) */
+/* Default size of the stack for a thread (in bytes) */
 #define UTHREAD_STACK_SIZE 32768
 
+/*
+ * Stacks:
+ * Every stack is an anonymous mapping of its own, whose pages only get
+ * committed when first touched, with an inaccessible guard page right below
+ * it, so that an overflow faults instead of silently corrupting memory. The
+ * stacks of exited threads are kept in a pool, by size and guard size (which
+ * may be configured differently between runs), for the next threads. The
+ * link of a pooled stack is stored at its top.
+ */
+#define STACK_POOL_SIZES 8
+#define STACK_POOL_MAX   1024    // pooled stacks of each size
+
+struct pooled_stack {
+	struct pooled_stack *next;
+};
+
+struct stack_bucket {
+	size_t              size;
+	size_t              guard_size;
+	struct pooled_stack *stacks;
+	int                 num_stacks;
+};
+
+static pthread_mutex_t     stack_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stack_bucket stack_pool[STACK_POOL_SIZES];
+static size_t              default_stack_size = UTHREAD_STACK_SIZE;
+static int                 has_guard_page = 1;
+
+#ifdef UTHREAD_CTX_ASM
+/*
+ * Context switch:
+ * A thread switches out by calling uthread_ctx_swap(), so only the registers
+ * that a function must preserve according to the ABI, and the floating-point
+ * control registers, need saving. They are pushed on the stack of the thread,
+ * and its context is just the resulting stack pointer. Unlike swapcontext(),
+ * the signal mask is not switched, which saves a system call per switch.
+ *
+ * A new thread starts on a frame which resumes into uthread_ctx_entry(),
+ * holding the address of uthread_ctx_bootstrap() and its two arguments in
+ * preserved registers. The frame is laid out from the lowest address.
+ */
+void uthread_ctx_swap(void **prev_sp, void *next_sp)
+	__attribute__((visibility("hidden")));
+void uthread_ctx_entry(void) __attribute__((visibility("hidden")));
+
+#if defined(__x86_64__)
+
+/* fpctrl (MXCSR, x87 control word), r15, r14, r13, r12, rbx, rbp, return */
+#define CTX_FRAME_WORDS 8
+#define CTX_FRAME_FPCTRL 0
+#define CTX_FRAME_ARG    3    // r13
+#define CTX_FRAME_FUNC   4    // r12
+#define CTX_FRAME_BOOT   5    // rbx
+#define CTX_FRAME_ENTRY  7    // return address
+#define CTX_FPCTRL_INIT  (0x1f80 | 0x037fULL << 32)
+
+__asm__(
+	"	.text\n"
+	"	.globl	uthread_ctx_swap\n"
+	"	.hidden	uthread_ctx_swap\n"
+	"	.type	uthread_ctx_swap, @function\n"
+	"	.p2align 4\n"
+	"uthread_ctx_swap:\n"
+	"	pushq	%rbp\n"
+	"	pushq	%rbx\n"
+	"	pushq	%r12\n"
+	"	pushq	%r13\n"
+	"	pushq	%r14\n"
+	"	pushq	%r15\n"
+	"	subq	$8, %rsp\n"
+	"	stmxcsr	(%rsp)\n"
+	"	fnstcw	4(%rsp)\n"
+	"	movq	%rsp, (%rdi)\n"
+	"	movq	%rsi, %rsp\n"
+	"	ldmxcsr	(%rsp)\n"
+	"	fldcw	4(%rsp)\n"
+	"	addq	$8, %rsp\n"
+	"	popq	%r15\n"
+	"	popq	%r14\n"
+	"	popq	%r13\n"
+	"	popq	%r12\n"
+	"	popq	%rbx\n"
+	"	popq	%rbp\n"
+	"	ret\n"
+	"	.size	uthread_ctx_swap, .-uthread_ctx_swap\n"
+	"\n"
+	"	.globl	uthread_ctx_entry\n"
+	"	.hidden	uthread_ctx_entry\n"
+	"	.type	uthread_ctx_entry, @function\n"
+	"uthread_ctx_entry:\n"
+	"	movq	%r12, %rdi\n"
+	"	movq	%r13, %rsi\n"
+	"	call	*%rbx\n"
+	"	ud2\n"
+	"	.size	uthread_ctx_entry, .-uthread_ctx_entry\n"
+);
+
+#elif defined(__aarch64__)
+
+/* x19-x28, fp, lr, d8-d15, fpcr, padding */
+#define CTX_FRAME_WORDS 22
+#define CTX_FRAME_FUNC   0    // x19
+#define CTX_FRAME_ARG    1    // x20
+#define CTX_FRAME_BOOT   2    // x21
+#define CTX_FRAME_ENTRY  11   // lr
+#define CTX_FRAME_FPCTRL 20
+#define CTX_FPCTRL_INIT  0
+
+__asm__(
+	"	.text\n"
+	"	.globl	uthread_ctx_swap\n"
+	"	.hidden	uthread_ctx_swap\n"
+	"	.type	uthread_ctx_swap, %function\n"
+	"	.p2align 4\n"
+	"uthread_ctx_swap:\n"
+	"	sub	sp, sp, #176\n"
+	"	stp	x19, x20, [sp, #0]\n"
+	"	stp	x21, x22, [sp, #16]\n"
+	"	stp	x23, x24, [sp, #32]\n"
+	"	stp	x25, x26, [sp, #48]\n"
+	"	stp	x27, x28, [sp, #64]\n"
+	"	stp	x29, x30, [sp, #80]\n"
+	"	stp	d8, d9, [sp, #96]\n"
+	"	stp	d10, d11, [sp, #112]\n"
+	"	stp	d12, d13, [sp, #128]\n"
+	"	stp	d14, d15, [sp, #144]\n"
+	"	mrs	x9, fpcr\n"
+	"	str	x9, [sp, #160]\n"
+	"	mov	x9, sp\n"
+	"	str	x9, [x0]\n"
+	"	mov	sp, x1\n"
+	"	ldp	x19, x20, [sp, #0]\n"
+	"	ldp	x21, x22, [sp, #16]\n"
+	"	ldp	x23, x24, [sp, #32]\n"
+	"	ldp	x25, x26, [sp, #48]\n"
+	"	ldp	x27, x28, [sp, #64]\n"
+	"	ldp	x29, x30, [sp, #80]\n"
+	"	ldp	d8, d9, [sp, #96]\n"
+	"	ldp	d10, d11, [sp, #112]\n"
+	"	ldp	d12, d13, [sp, #128]\n"
+	"	ldp	d14, d15, [sp, #144]\n"
+	"	ldr	x9, [sp, #160]\n"
+	"	msr	fpcr, x9\n"
+	"	add	sp, sp, #176\n"
+	"	ret\n"
+	"	.size	uthread_ctx_swap, .-uthread_ctx_swap\n"
+	"\n"
+	"	.globl	uthread_ctx_entry\n"
+	"	.hidden	uthread_ctx_entry\n"
+	"	.type	uthread_ctx_entry, %function\n"
+	"uthread_ctx_entry:\n"
+	"	mov	x0, x19\n"
+	"	mov	x1, x20\n"
+	"	blr	x21\n"
+	"	brk	#0\n"
+	"	.size	uthread_ctx_entry, .-uthread_ctx_entry\n"
+);
+
+#endif
+#endif /* UTHREAD_CTX_ASM */
+
 void uthread_ctx_switch(uthread_ctx_t *prev, uthread_ctx_t *next)
 {
+#ifdef UTHREAD_CTX_ASM
+	uthread_ctx_swap(&prev->sp, next->sp);
+#else
 	/*
 	 * swapcontext() saves the current context in structure pointer by @prev
 	 * and actives the context pointed by @next
@@ -19,16 +187,97 @@ void uthread_ctx_switch(uthread_ctx_t *prev, uthread_ctx_t *next)
 		perror("swapcontext");
 		exit(1);
 	}
+#endif
+}
+
+void uthread_stack_config(size_t size, int guard)
+{
+	if (size)
+		default_stack_size = size;
+	has_guard_page = guard;
+}
+
+size_t uthread_ctx_stack_size(size_t size)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	/* Whole pages, with room for the link of the pool */
+	if (size == 0)
+		size = default_stack_size;
+	if (size < page_size)
+		size = page_size;
+	return (size + page_size - 1) & ~(page_size - 1);
 }
 
-void *uthread_ctx_alloc_stack(void)
+size_t uthread_ctx_stack_guard(void)
 {
-	return malloc(UTHREAD_STACK_SIZE);
+	return has_guard_page ? sysconf(_SC_PAGESIZE) : 0;
 }
 
-void uthread_ctx_destroy_stack(void *top_of_stack)
+void *uthread_ctx_alloc_stack(size_t *size, size_t *guard_size)
 {
-	free(top_of_stack);
+	struct stack_bucket *bucket = NULL;
+	char *stack;
+
+	*size = uthread_ctx_stack_size(*size);
+	*guard_size = uthread_ctx_stack_guard();
+
+	pthread_mutex_lock(&stack_pool_lock);
+	for (int i = 0; i < STACK_POOL_SIZES; i++) {
+		if (stack_pool[i].size == *size &&
+		    stack_pool[i].guard_size == *guard_size) {
+			bucket = &stack_pool[i];
+			break;
+		}
+	}
+	if (bucket && bucket->stacks) {
+		struct pooled_stack *link = bucket->stacks;
+		bucket->stacks = link->next;
+		bucket->num_stacks--;
+		pthread_mutex_unlock(&stack_pool_lock);
+		return (char *)(link + 1) - *size;
+	}
+	pthread_mutex_unlock(&stack_pool_lock);
+
+	stack = mmap(NULL, *size + *guard_size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+	if (stack == MAP_FAILED)
+		return NULL;
+	if (*guard_size && mprotect(stack, *guard_size, PROT_NONE)) {
+		munmap(stack, *size + *guard_size);
+		return NULL;
+	}
+	return stack + *guard_size;
+}
+
+void uthread_ctx_destroy_stack(void *top_of_stack, size_t size, size_t guard_size)
+{
+	struct stack_bucket *bucket = NULL;
+
+	pthread_mutex_lock(&stack_pool_lock);
+	for (int i = 0; i < STACK_POOL_SIZES; i++) {
+		if (stack_pool[i].size == size &&
+		    stack_pool[i].guard_size == guard_size) {
+			bucket = &stack_pool[i];
+			break;
+		}
+		if (stack_pool[i].size == 0 && bucket == NULL)
+			bucket = &stack_pool[i];
+	}
+	if (bucket && bucket->num_stacks < STACK_POOL_MAX) {
+		struct pooled_stack *link = (struct pooled_stack *)((char *)top_of_stack + size) - 1;
+		bucket->size = size;
+		bucket->guard_size = guard_size;
+		link->next = bucket->stacks;
+		bucket->stacks = link;
+		bucket->num_stacks++;
+		pthread_mutex_unlock(&stack_pool_lock);
+		return;
+	}
+	pthread_mutex_unlock(&stack_pool_lock);
+
+	/* The guard page, if any, is part of the mapping */
+	munmap((char *)top_of_stack - guard_size, size + guard_size);
 }
 
 /*
@@ -38,16 +287,32 @@ void uthread_ctx_destroy_stack(void *top_of_stack)
  */
 static void uthread_ctx_bootstrap(uthread_func_t func, void *arg)
 {
-	/* TODO: PART 1 - Phase 4 */
-
 	/* Execute thread and when done, exit */
 	func(arg);
 	uthread_exit();
 }
 
-int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack,
+int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack, size_t stack_size,
 		     uthread_func_t func, void *arg)
 {
+#ifdef UTHREAD_CTX_ASM
+	/*
+	 * Build the first frame below the (aligned) end of the stack, leaving
+	 * 16 bytes so that uthread_ctx_entry() runs with an aligned stack
+	 */
+	uintptr_t end = ((uintptr_t)top_of_stack + stack_size) & ~(uintptr_t)15;
+	void **frame = (void **)(end - 16) - CTX_FRAME_WORDS;
+
+	memset(frame, 0, CTX_FRAME_WORDS * sizeof(void *));
+	frame[CTX_FRAME_FPCTRL] = (void *)(uintptr_t)CTX_FPCTRL_INIT;
+	frame[CTX_FRAME_FUNC]   = (void *)func;
+	frame[CTX_FRAME_ARG]    = arg;
+	frame[CTX_FRAME_BOOT]   = (void *)uthread_ctx_bootstrap;
+	frame[CTX_FRAME_ENTRY]  = (void *)uthread_ctx_entry;
+	uctx->sp = frame;
+
+	return 0;
+#else
 	/*
 	 * Initialize the passed context @uctx to the currently active context
 	 */
@@ -58,7 +323,7 @@ int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack,
 	 * Change context @uctx's stack to the specified stack
 	 */
 	uctx->uc_stack.ss_sp = top_of_stack;
-	uctx->uc_stack.ss_size = UTHREAD_STACK_SIZE;
+	uctx->uc_stack.ss_size = stack_size;
 
 	/*
 	 * Finish setting up context @uctx:
@@ -71,5 +336,6 @@ int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack,
 		    2, func, arg);
 
 	return 0;
+#endif
 }
 
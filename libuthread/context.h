@@ -1,12 +1,21 @@
 #ifndef _CONTEXT_H
 #define _CONTEXT_H
 
-#include <ucontext.h>
-
 #include "uthread.h"
 
 #ifdef _UTHREAD_PRIVATE
 
+/*
+ * Contexts are switched by hand on x86-64 and aarch64, unless the library is
+ * built with UTHREAD_CTX_UCONTEXT defined, and with swapcontext() otherwise
+ */
+#if !defined(UTHREAD_CTX_UCONTEXT) && \
+	(defined(__x86_64__) || defined(__aarch64__))
+#define UTHREAD_CTX_ASM
+#else
+#include <ucontext.h>
+#endif
+
 /*
  * uthread_ctx_t - User-level thread context
  *
@@ -17,40 +26,71 @@
  * uthread_ctx_init(). Once initialized, it can be switched to with
  * uthread_ctx_switch().
  */
+#ifdef UTHREAD_CTX_ASM
+typedef struct {
+	void *sp;	/* saved registers are on the stack */
+} uthread_ctx_t;
+#else
 typedef ucontext_t uthread_ctx_t;
+#endif
 
 /*
  * uthread_ctx_switch - Switch between two execution contexts
  * @prev: Pointer to the execution context structure in which to save the
  *	currently running thread
  * @next: Pointer to the execution context structure to resume
+ *
+ * The signal mask is not part of the context, and may not be switched: it
+ * must be the same for all the threads.
  */
 void uthread_ctx_switch(uthread_ctx_t *prev, uthread_ctx_t *next);
 
+/*
+ * uthread_ctx_stack_size - Get the actual size of a stack
+ * @size: Size of the stack in bytes, or 0 for the default size
+ *
+ * Return: @size rounded up to whole pages, or the default size
+ */
+size_t uthread_ctx_stack_size(size_t size);
+
+/*
+ * uthread_ctx_stack_guard - Get the guard size of new stacks
+ *
+ * Return: Size of the guard page below new stacks, 0 if they have none
+ */
+size_t uthread_ctx_stack_guard(void);
+
 /*
  * uthread_ctx_alloc_stack - Allocate stack segment
+ * @size: Size of the stack in bytes, or 0 for the default size. Set to the
+ *	actual size, rounded up to whole pages.
+ * @guard_size: Set to the size of the guard page below the stack, as
+ *	configured when it was mapped
  *
  * Return: Pointer to a valid stack segment, or NULL in case of failure
  */
-void *uthread_ctx_alloc_stack(void);
+void *uthread_ctx_alloc_stack(size_t *size, size_t *guard_size);
 
 /*
  * uthread_ctx_destroy_stack - Deallocate stack segment
  * @top_of_stack: Address of stack to deallocate
+ * @size: Size of the stack, as set by uthread_ctx_alloc_stack()
+ * @guard_size: Guard size of the stack, as set by uthread_ctx_alloc_stack()
  */
-void uthread_ctx_destroy_stack(void *top_of_stack);
+void uthread_ctx_destroy_stack(void *top_of_stack, size_t size, size_t guard_size);
 
 /*
  * uthread_ctx_init - Initialize a thread's execution context
  * @uctx: Pointer to thread context to initialize
  * @top_of_stack: Pointer to a valid stack segment, as allocated by
  *	uthread_ctx_alloc_stack()
+ * @stack_size: Size of the stack segment
  * @func: Function to be executed by the thread
  * @arg: Argument to pass to the thread
  *
  * Return: 0 if @uctx was properly initialized, or -1 in case of failure
  */
-int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack,
+int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack, size_t stack_size,
 		     uthread_func_t func, void *arg);
 
 #else
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,8 +13,8 @@
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
-/* Invalid file descriptor */
-#define INVALID_FD -1
+/* Size of the buffer for copies that the kernel cannot do by itself */
+#define COPY_BUF_SIZE (16 * BLOCK_SIZE)
 
 /* Disk instance description */
 struct disk {
@@ -22,8 +24,8 @@ struct disk {
 	size_t bcount;
 };
 
-/* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+/* Currently open virtual disk of the default API (none by default) */
+static struct disk *default_disk;
 
 int block_disk_create(const char *diskname, size_t bcount)
 {
@@ -52,117 +54,377 @@ int block_disk_create(const char *diskname, size_t bcount)
 	return 0;
 }
 
-int block_disk_open(const char *diskname)
+disk_t block_disk_open_r(const char *diskname)
 {
 	int fd;
 	struct stat st;
+	struct disk *disk;
 
 	/* Parameter checking */
 	if (!diskname) {
 		block_error("invalid file diskname");
-		return -1;
-	}
-
-	if (disk.fd != INVALID_FD) {
-		block_error("disk already open");
-		return -1;
+		return NULL;
 	}
 
 	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
 		perror("open");
-		return -1;
+		return NULL;
 	}
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
-		return -1;
+		close(fd);
+		return NULL;
 	}
 
 	if (st.st_size % BLOCK_SIZE != 0) {
 		block_error("size '%zu' is not multiple of '%d'",
 			    st.st_size, BLOCK_SIZE);
+		close(fd);
+		return NULL;
+	}
+
+	if (!(disk = malloc(sizeof(struct disk)))) {
+		perror("malloc");
+		close(fd);
+		return NULL;
+	}
+
+	disk->fd = fd;
+	disk->bcount = st.st_size / BLOCK_SIZE;
+
+	return disk;
+}
+
+int block_disk_close_r(disk_t disk)
+{
+	if (!disk) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	close(disk->fd);
+	free(disk);
 
 	return 0;
 }
 
-int block_disk_close(void)
+int block_disk_count_r(disk_t disk)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	return disk->bcount;
+}
+
+int block_write_r(disk_t disk, size_t block, const void *buf)
+{
+	if (!disk) {
+		block_error("no disk currently open");
+		return -1;
+	}
 
-	disk.fd = INVALID_FD;
+	if (block >= disk->bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block, disk->bcount);
+		return -1;
+	}
 
-	return 0;
+	/* Positioned I/O: the disk can be shared by several threads */
+	return block_write_run_r(disk, block, 1, buf);
 }
 
-int block_disk_count(void)
+int block_read_r(disk_t disk, size_t block, void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	return disk.bcount;
+	if (block >= disk->bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block, disk->bcount);
+		return -1;
+	}
+
+	/* Positioned I/O: the disk can be shared by several threads */
+	return block_read_run_r(disk, block, 1, buf);
 }
 
-int block_write(size_t block, const void *buf)
+int block_write_run_r(disk_t disk, size_t block, size_t count, const void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	size_t len = count * BLOCK_SIZE;
+	size_t done = 0;
+	ssize_t ret;
+
+	if (!disk) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	if (block + count > disk->bcount) {
+		block_error("block index out of bounds (%zu+%zu/%zu)",
+			    block, count, disk->bcount);
 		return -1;
 	}
 
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	while (done < len) {
+		ret = pwrite(disk->fd, (const char *)buf + done, len - done,
+			     block * BLOCK_SIZE + done);
+		if (ret < 0) {
+			perror("pwrite");
+			return -1;
+		}
+		done += ret;
+	}
+
+	return 0;
+}
+
+int block_read_run_r(disk_t disk, size_t block, size_t count, void *buf)
+{
+	size_t len = count * BLOCK_SIZE;
+	size_t done = 0;
+	ssize_t ret;
+
+	if (!disk) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	if (block + count > disk->bcount) {
+		block_error("block index out of bounds (%zu+%zu/%zu)",
+			    block, count, disk->bcount);
 		return -1;
 	}
 
+	while (done < len) {
+		ret = pread(disk->fd, (char *)buf + done, len - done,
+			    block * BLOCK_SIZE + done);
+		if (ret < 0) {
+			perror("pread");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("unexpected end of disk");
+			return -1;
+		}
+		done += ret;
+	}
+
 	return 0;
 }
 
-int block_read(size_t block, void *buf)
+/* Copy through a buffer, when the kernel cannot copy by itself */
+static ssize_t copy_buffered(int fd_in, off_t *off_in, int fd_out,
+			     off_t *off_out, size_t len)
+{
+	char *buf;
+	size_t done = 0;
+	ssize_t ret, out;
+
+	buf = malloc(COPY_BUF_SIZE);
+	if (!buf) {
+		perror("malloc");
+		return -1;
+	}
+
+	while (done < len) {
+		size_t chunk = len - done < COPY_BUF_SIZE ?
+			len - done : COPY_BUF_SIZE;
+
+		if (off_in)
+			ret = pread(fd_in, buf, chunk, *off_in);
+		else
+			ret = read(fd_in, buf, chunk);
+		if (ret < 0) {
+			perror("read");
+			free(buf);
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		if (off_in)
+			*off_in += ret;
+
+		for (ssize_t written = 0; written < ret; written += out) {
+			if (off_out) {
+				out = pwrite(fd_out, buf + written,
+					     ret - written, *off_out);
+				if (out > 0)
+					*off_out += out;
+			} else {
+				out = write(fd_out, buf + written,
+					    ret - written);
+			}
+			if (out < 0) {
+				perror("write");
+				free(buf);
+				return -1;
+			}
+		}
+		done += ret;
+	}
+
+	free(buf);
+	return done;
+}
+
+/* The kernel cannot copy between this pair of files */
+static int is_copy_unsupported(int err)
 {
-	if (disk.fd == INVALID_FD) {
+	return err == EINVAL || err == EXDEV || err == ENOSYS ||
+		err == EOPNOTSUPP || err == EBADF;
+}
+
+/*
+ * Copy @len bytes between the disk and a host file, with copy_file_range()
+ * between regular files, with splice() from or to a pipe, or through a buffer
+ */
+static ssize_t copy_range(int fd_in, off_t *off_in, int fd_out,
+			  off_t *off_out, size_t len)
+{
+	size_t done = 0;
+	ssize_t ret;
+	int use_splice = 0;
+
+	while (done < len) {
+		if (!use_splice)
+			ret = copy_file_range(fd_in, off_in, fd_out, off_out,
+					      len - done, 0);
+		else
+			ret = splice(fd_in, off_in, fd_out, off_out,
+				     len - done, 0);
+
+		if (ret < 0 && is_copy_unsupported(errno)) {
+			if (!use_splice) {
+				use_splice = 1;
+				continue;
+			}
+			ret = copy_buffered(fd_in, off_in, fd_out, off_out,
+					    len - done);
+			if (ret < 0)
+				return -1;
+			return done + ret;
+		}
+		if (ret < 0) {
+			perror(use_splice ? "splice" : "copy_file_range");
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
+ssize_t block_import_run_r(disk_t disk, size_t block, size_t count, int fd)
+{
+	off_t off;
+
+	if (!disk) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	if (block + count > disk->bcount) {
+		block_error("block index out of bounds (%zu+%zu/%zu)",
+			    block, count, disk->bcount);
 		return -1;
 	}
 
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	off = block * BLOCK_SIZE;
+	return copy_range(fd, NULL, disk->fd, &off, count * BLOCK_SIZE);
+}
+
+int block_export_run_r(disk_t disk, size_t block, size_t offset, size_t len, int fd)
+{
+	off_t off;
+	ssize_t ret;
+
+	if (!disk) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	if ((block * BLOCK_SIZE + offset + len + BLOCK_SIZE - 1) / BLOCK_SIZE
+	    > disk->bcount) {
+		block_error("block index out of bounds (%zu+%zu/%zu)",
+			    block, (offset + len) / BLOCK_SIZE, disk->bcount);
 		return -1;
 	}
 
+	off = block * BLOCK_SIZE + offset;
+	ret = copy_range(disk->fd, &off, fd, NULL, len);
+	if (ret < 0)
+		return -1;
+	if (ret < len) {
+		block_error("unexpected end of disk");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Default API: the same operations, on the disk opened by block_disk_open()
+ */
+int block_disk_open(const char *diskname)
+{
+	if (default_disk) {
+		block_error("disk already open");
+		return -1;
+	}
+
+	if (!(default_disk = block_disk_open_r(diskname)))
+		return -1;
+
 	return 0;
 }
 
+int block_disk_close(void)
+{
+	int ret = block_disk_close_r(default_disk);
+
+	default_disk = NULL;
+
+	return ret;
+}
+
+int block_disk_count(void)
+{
+	return block_disk_count_r(default_disk);
+}
+
+int block_write(size_t block, const void *buf)
+{
+	return block_write_r(default_disk, block, buf);
+}
+
+int block_read(size_t block, void *buf)
+{
+	return block_read_r(default_disk, block, buf);
+}
+
+int block_write_run(size_t block, size_t count, const void *buf)
+{
+	return block_write_run_r(default_disk, block, count, buf);
+}
+
+int block_read_run(size_t block, size_t count, void *buf)
+{
+	return block_read_run_r(default_disk, block, count, buf);
+}
+
+ssize_t block_import_run(size_t block, size_t count, int fd)
+{
+	return block_import_run_r(default_disk, block, count, fd);
+}
+
+int block_export_run(size_t block, size_t offset, size_t len, int fd)
+{
+	return block_export_run_r(default_disk, block, offset, len, fd);
+}
@@ -2,6 +2,7 @@
 #define _DISK_H
 
 #include <stddef.h>
+#include <sys/types.h>
 
 #ifdef _UTHREAD_PRIVATE
 
@@ -76,6 +77,105 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_run - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf (@count x %BLOCK_SIZE bytes) in the virtual
+ * disk's blocks @block to @block + @count - 1, with a single I/O operation.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible or if the
+ * writing operation fails. 0 otherwise.
+ */
+int block_write_run(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_run - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1
+ * (@count x %BLOCK_SIZE bytes) into buffer @buf, with a single I/O operation.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if the
+ * reading operation fails. 0 otherwise.
+ */
+int block_read_run(size_t block, size_t count, void *buf);
+
+/**
+ * block_import_run - Copy consecutive blocks from a host file to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @fd: Host file descriptor to read from, at its current file offset
+ *
+ * Copy @count x %BLOCK_SIZE bytes from host file @fd into the virtual disk's
+ * blocks @block to @block + @count - 1. The kernel copies the data itself
+ * (copy_file_range() or splice()) when it can, otherwise the data goes
+ * through a buffer. The file offset of @fd moves past the copied bytes.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if the
+ * copy fails. Otherwise the number of bytes copied, which is smaller than
+ * requested if the end of @fd is reached first.
+ */
+ssize_t block_import_run(size_t block, size_t count, int fd);
+
+/**
+ * block_export_run - Copy data from consecutive blocks of disk to a host file
+ * @block: Index of the first block to read from
+ * @offset: Offset of the data in block @block
+ * @len: Number of bytes to copy
+ * @fd: Host file descriptor to write to, at its current file offset
+ *
+ * Copy @len bytes, starting at byte @offset of the virtual disk's block
+ * @block, to host file @fd. The kernel copies the data itself
+ * (copy_file_range() or splice()) when it can, otherwise the data goes
+ * through a buffer. The file offset of @fd moves past the copied bytes.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if the
+ * copy fails. 0 otherwise.
+ */
+int block_export_run(size_t block, size_t offset, size_t len, int fd);
+
+/**
+ * disk_t - Virtual disk handle
+ *
+ * The functions above operate on the single virtual disk opened with
+ * block_disk_open(). Their reentrant variants below, suffixed with _r,
+ * operate on a disk handle instead, so that several virtual disks can be open
+ * at the same time. Each variant takes the handle as first argument, and
+ * otherwise behaves like its counterpart.
+ */
+typedef struct disk* disk_t;
+
+/**
+ * block_disk_open_r - Open virtual disk file
+ * @diskname: Name of the virtual disk file
+ *
+ * Return: Handle of the open virtual disk, or NULL if @diskname is invalid or
+ * if the virtual disk file cannot be opened.
+ */
+disk_t block_disk_open_r(const char *diskname);
+
+/**
+ * block_disk_close_r - Close virtual disk file and free its handle
+ * @disk: Virtual disk handle
+ *
+ * Return: -1 if @disk is NULL. 0 otherwise.
+ */
+int block_disk_close_r(disk_t disk);
+
+int block_disk_count_r(disk_t disk);
+int block_write_r(disk_t disk, size_t block, const void *buf);
+int block_read_r(disk_t disk, size_t block, void *buf);
+int block_write_run_r(disk_t disk, size_t block, size_t count, const void *buf);
+int block_read_run_r(disk_t disk, size_t block, size_t count, void *buf);
+ssize_t block_import_run_r(disk_t disk, size_t block, size_t count, int fd);
+int block_export_run_r(disk_t disk, size_t block, size_t offset, size_t len,
+		       int fd);
+
 #else
 #error "Private header, can't be included from applications directly"
 #endif
@@ -1,12 +1,16 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <unistd.h>
 
 #define _UTHREAD_PRIVATE
 #include "disk.h"
 #include "fs.h"
+#include "lz.h"
+#include "preempt.h"
 
 
 // Very nicely display "Function Source of error: the error message"
@@ -16,6 +20,17 @@
 #define EOC 0xFFFF
 #define EMPTY 0
 
+// Files reserved for the file system's own metadata start with this prefix,
+// and are hidden from the public API
+#define SYSFILE_PREFIX ".fs."
+#define REFCNT_FILE    ".fs.refcnt"
+#define SNAPSHOT_FILE  ".fs.snap.%d"
+#define DEDUP_FILE     ".fs.dedup"
+#define HOLES_FILE     ".fs.holes"
+
+// Size of the buffer for host copies which go through memory
+#define HOST_BUF_SIZE (16 * BLOCK_SIZE)
+
 typedef enum { false, true } bool;
 
 /* 
@@ -61,7 +76,8 @@ struct FAT_t {
  * 0x00		16				Filename (including NULL character)
  * 0x10		4				Size of the file (in bytes)
  * 0x14		2				Index of the first data block
- * 0x16		10				Unused/Padding
+ * 0x16		1				Flags (0 for a plain file)
+ * 0x17		9				Unused/Padding
  *
  */
 
@@ -69,141 +85,570 @@ struct rootdirectory_t {
 	char     filename[FS_FILENAME_LEN];
 	uint32_t file_size;
 	uint16_t start_data_block;
-	uint8_t  unused[10];
+	uint8_t  flags;
+	uint8_t  unused[9];
 } __attribute__((packed));
 
+#define FILE_COMPRESSED 0x1
+
+
+/*
+ * Compressed files:
+ * The data of a file flagged FILE_COMPRESSED is split in chunks of
+ * CHUNK_BLOCKS logical blocks, compressed one by one. The first block of its
+ * chain holds the chunk map: the compressed length of every chunk, 0 for a
+ * chunk never written (which reads as zeros) and CHUNK_SIZE for a chunk that
+ * did not compress and is stored as is. The compressed chunks follow in the
+ * rest of the chain, each one taking as many blocks as its length needs. The
+ * file size in the root directory is the uncompressed size.
+ *
+ * Decompressed chunks are kept in a small direct-mapped cache, keyed by the
+ * first block of the compressed chunk.
+ */
+#define CHUNK_BLOCKS          4
+#define CHUNK_SIZE            (CHUNK_BLOCKS * BLOCK_SIZE)
+#define CHUNK_MAX_COUNT       (BLOCK_SIZE / sizeof(uint16_t))
+#define CHUNK_CACHE_NUM_SLOTS 4
+
+struct chunk_slot_t {
+	bool     is_valid;
+	uint16_t block;
+	char     data[CHUNK_SIZE];
+};
+
 
 struct file_descriptor_t {
     bool   is_used;       
     int    file_index;              
     size_t offset;  
+    int    flags;
 	char   file_name[FS_FILENAME_LEN];
+	struct rootdirectory_t *dir;    // live root directory, or a snapshot's
+};
+
+
+/*
+ * Chain cache:
+ * In-memory only, one entry per root directory entry. Remembers the last data
+ * block of a file's chain and the length of the chain, so that extending a
+ * file does not require walking the FAT from its first data block. The entry
+ * is filled lazily the first time the chain is needed. It also records
+ * whether the chain may contain shared blocks: set when the file gets
+ * cloned, snapshotted or deduplicated, and cleared once a write has copied
+ * all of them, so that writing to a file which shares nothing never looks for
+ * shared blocks.
+ */
+struct chain_cache_t {
+	bool     is_valid;
+	bool     may_share;
+	uint16_t tail_block;
+	uint16_t num_blocks;
+};
+
+
+/*
+ * Block reference counts:
+ * One 16-bit counter per data block, holding the number of references to the
+ * block besides the first one. A block is shared when its counter is not 0,
+ * e.g. the first block of a cloned file which is referenced by both
+ * directory entries. The rest of a shared chain is reached through the
+ * shared block, so only the block where two chains join is counted. The
+ * table is saved in the REFCNT_FILE system file whenever a block is shared.
+ */
+
+
+/*
+ * Snapshots:
+ * A snapshot is a frozen copy of the root directory, saved in the system file
+ * SNAPSHOT_FILE with the snapshot number. Creating one counts an extra
+ * reference on the first block of every file, so from then on the live file
+ * system copies a block before modifying it, and the chains reachable from
+ * the frozen copy (blocks and FAT entries) never change. The superblock never
+ * changes either. Mounted snapshots are loaded in memory and read-only.
+ */
+
+
+/*
+ * Buffer cache:
+ * In-memory only. A small direct-mapped, write-back cache of data blocks.
+ * Partially read or written blocks go through it, so that repeated small
+ * writes into the same block are merged in memory and written back once,
+ * when the slot gets reused or when the file system is unmounted. Whole
+ * blocks bypass the cache: writes drop the cached copy, reads are patched
+ * with the dirty cached copy.
+ */
+#define CACHE_NUM_SLOTS 64
+
+struct cache_slot_t {
+	pthread_mutex_t lock;
+	unsigned int    writebacks;   // number of blocks written back from it
+	bool            is_valid;
+	bool            is_dirty;
+	uint16_t        block;
+	char            data[BLOCK_SIZE];
+};
+
+
+/*
+ * Block deduplication:
+ * Every whole block written through a file descriptor opened with FS_O_DEDUP
+ * gets the hash of its content recorded, in a table with one 32-bit hash per
+ * data block (0 when unknown) and a hash index to find the blocks with a
+ * given hash. A block loses its hash as soon as it is modified or freed.
+ *
+ * When such a file is closed, the blocks at the end of its chain which are
+ * identical to blocks of other chains (same hash, then same bytes) are
+ * replaced by those blocks, shared through their reference counts. A FAT
+ * entry links a block to a single next block, so only chain suffixes can be
+ * shared: the search walks back from the tail of the file and stops at the
+ * first block without a duplicate. The hash table is saved in the DEDUP_FILE
+ * system file whenever a block has a hash.
+ */
+
+
+/*
+ * Holes:
+ * A write past the end of a file extends its chain up to the written blocks.
+ * The blocks of the chain that are never written are holes: they read as
+ * zeros, without any I/O, and get their data on their first write. A bitmap
+ * in memory holds one bit per data block, set for a hole, and is saved in
+ * the HOLES_FILE system file whenever a block is a hole. Freed blocks are
+ * never holes.
+ */
+
+
+/*
+ * Locking:
+ * The API of an instance can be called from several pthreads at once. The
+ * directory lock is taken for reading by lookups and data I/O, and for
+ * writing by the calls which change the set of files (create, delete, clone,
+ * snapshots, closing in dedup mode). Data I/O then takes the lock of the
+ * file's directory entry, for reading by fs_read() and fs_export(), and for
+ * writing by fs_write() and fs_import(), so that readers of different files
+ * run in parallel and lookups never wait for a data write.
+ *
+ * A file's chain is only changed by the writer holding its lock. Free
+ * blocks, and the reference counts of shared blocks, are managed under the
+ * allocator lock. The buffer cache has a lock per slot, the chunk cache and
+ * the block hashes have theirs, and the hole bitmap is updated atomically.
+ * Locks are taken in the order: directory, file, fd table, allocator, pool
+ * list, pool, chunk cache, cache slot, block hashes.
+ *
+ * A file descriptor must not be used by several threads at once, and
+ * mounting or unmounting must not race with any other call.
+ *
+ * The locks block the whole pthread, so the uthreads are never preempted
+ * inside a call: another uthread of the same pthread waiting for a lock held
+ * by the preempted one would deadlock.
+ */
+
+
+/*
+ * Allocation pools:
+ * In-memory only. Every thread which allocates blocks gets a pool: an extent
+ * of contiguous free blocks, reserved in one go under the allocator lock
+ * (their FAT entries read EOC, so that no other allocation picks them, and
+ * they still count as free). Extending a chain takes the next block of the
+ * thread's pool under the pool's own lock only, and the pool gets refilled
+ * from the first free blocks when empty, so the files written by a thread
+ * stay contiguous. A pool gives its remaining blocks back when its thread
+ * closes a file or exits, and all pools do when the disk is full or the file
+ * system is unmounted.
+ */
+#define POOL_EXTENT_BLOCKS 64
+
+struct alloc_pool_t {
+	pthread_mutex_t     lock;
+	fs_t                fs;
+	int                 next_block;   // next reserved block
+	int                 end_block;    // end of the reserved extent
+	struct alloc_pool_t *next;        // next pool of the instance
 };
 
 
-struct superblock_t      *superblock;
-struct rootdirectory_t   *root_dir_block;
-struct FAT_t             *FAT_blocks;
-struct file_descriptor_t fd_table[FS_OPEN_MAX_COUNT]; 
+/*
+ * File system instance:
+ * All the state of a mounted file system. The public API operates on a
+ * default instance, and its _r variants on an instance of the caller, so that
+ * several disks can be mounted at the same time.
+ */
+struct fs {
+	disk_t                   disk;
+	pthread_rwlock_t         dir_lock;
+	pthread_rwlock_t         file_locks[FS_FILE_MAX_COUNT];
+	pthread_mutex_t          fd_lock;
+	pthread_mutex_t          alloc_lock;
+	pthread_mutex_t          chunk_lock;
+	pthread_mutex_t          hash_lock;
+	pthread_mutex_t          pool_list_lock;
+	pthread_key_t            pool_key;
+	struct alloc_pool_t      *pools;
+	int                      num_pooled_blocks;
+	struct superblock_t      *superblock;
+	struct rootdirectory_t   *root_dir_block;
+	struct FAT_t             *FAT_blocks;
+	struct file_descriptor_t fd_table[FS_OPEN_MAX_COUNT];
+	struct chain_cache_t     chain_cache[FS_FILE_MAX_COUNT];
+	int                      first_free_block;
+	int                      num_free_blocks;
+	struct cache_slot_t      *block_cache;
+	uint16_t                 *block_refs;
+	struct chunk_slot_t      *chunk_cache;
+	struct rootdirectory_t   *snapshot_dirs[FS_SNAPSHOT_MAX_COUNT];
+	struct rootdirectory_t   *view_dir;
+	int                      view_snapshot;
+	uint32_t                 *block_hashes;
+	uint16_t                 *hash_buckets;
+	uint16_t                 *hash_next;
+	int                      num_hash_buckets;
+	uint8_t                  *hole_map;
+};
 
+static struct fs default_fs;
 
 // private API
-static bool error_free(const char *filename);
-static int  locate_file(const char* file_name);
-static bool is_open(const char* file_name);
-static int  locate_avail_fd();
-static int  get_num_FAT_free_blocks();
-static int  count_num_open_dir();
-static int  go_to_cur_FAT_block(int cur_fat_index, int iter_amount);
+static bool error_free(fs_t fs, const char *filename);
+static int  locate_file(fs_t fs, const char* file_name);
+static int  locate_file_in(struct rootdirectory_t *dir, const char* file_name);
+static bool is_open(fs_t fs, const char* file_name);
+static int  locate_avail_fd(fs_t fs);
+static int  get_num_FAT_free_blocks(fs_t fs);
+static int  count_num_open_dir(fs_t fs);
+static int  go_to_cur_FAT_block(fs_t fs, int cur_fat_index, int iter_amount);
+static int  alloc_data_block(fs_t fs);
+static void free_data_block(fs_t fs, int block);
+static int  reserve_extent(fs_t fs, int max_blocks, int *start_block);
+static struct alloc_pool_t *get_pool(fs_t fs);
+static int  take_pool_block(fs_t fs, struct alloc_pool_t *pool);
+static int  refill_pool(fs_t fs, struct alloc_pool_t *pool);
+static void return_pool(fs_t fs, struct alloc_pool_t *pool);
+static void reclaim_pools(fs_t fs);
+static int  pool_alloc_block(fs_t fs);
+static void release_pool(fs_t fs);
+static void pool_destructor(void *arg);
+static void init_pools(fs_t fs);
+static void destroy_pools(fs_t fs);
+static void load_chain_cache(fs_t fs, int file_index);
+static int  extend_chain(fs_t fs, int file_index, int amount);
+static int  get_run_length(fs_t fs, int cur_fat_index, int max_blocks);
+static char *cache_get_block(fs_t fs, int block, bool fill);
+static void cache_release_block(fs_t fs, int block);
+static void cache_mark_dirty(fs_t fs, int block);
+static void cache_drop_run(fs_t fs, int block, int amount);
+static void cache_save_writebacks(fs_t fs, unsigned int *writebacks);
+static void cache_patch_run(fs_t fs, int block, int amount, char *buf, unsigned int *writebacks);
+static int  cache_flush(fs_t fs);
+static bool is_sysfile_name(const char *filename);
+static int  create_entry(fs_t fs, const char *filename);
+static void remove_entry(fs_t fs, int file_index);
+static void release_chain(fs_t fs, int start_data_block);
+static int  load_snapshot(fs_t fs, int snapshot);
+static bool is_snapshot_busy(fs_t fs, int snapshot);
+static bool is_live_view(fs_t fs);
+static int  unshare_chain(fs_t fs, int file_index, int last_block, size_t offset, size_t count);
+static int  load_block_refs(fs_t fs);
+static int  store_block_refs(fs_t fs);
+static size_t reserve_write(fs_t fs, int file_index, size_t offset, size_t count, int *first_fat_index);
+static int  write_fd(fs_t fs, int fd, void *buf, size_t count, size_t offset, bool is_positioned);
+static int  read_fd(fs_t fs, int fd, void *buf, size_t count, size_t offset, bool is_positioned);
+static int  file_write_at(fs_t fs, int file_index, size_t offset, const void *buf, size_t count, int flags);
+static int  file_read_at(fs_t fs, struct rootdirectory_t *the_dir, size_t offset, void *buf, size_t count);
+static int  compressed_write_at(fs_t fs, int file_index, size_t offset, const void *buf, size_t count);
+static int  compressed_read_at(fs_t fs, struct rootdirectory_t *the_dir, size_t offset, void *buf, size_t count);
+static int  alloc_chunk_blocks(fs_t fs, int *blocks, int amount);
+static void free_chunk_blocks(fs_t fs, const int *blocks, int amount);
+static void replace_chain_segment(fs_t fs, int file_index, int prev_fat_index, int old_amount, const int *new_blocks, int new_amount);
+static int  get_chunk_num_blocks(uint16_t chunk_len);
+static char *chunk_cache_get(fs_t fs, int block, uint16_t chunk_len);
+static void chunk_cache_release(fs_t fs);
+static void chunk_cache_put(fs_t fs, int block, const char *data);
+static void chunk_cache_drop(fs_t fs, int block);
+static int  load_dedup_table(fs_t fs);
+static int  store_dedup_table(fs_t fs);
+static uint32_t hash_block(const char *data);
+static void dedup_index_insert(fs_t fs, int block, uint32_t hash);
+static void dedup_index_remove(fs_t fs, int block);
+static void dedup_chain(fs_t fs, int file_index);
+static int  load_hole_map(fs_t fs);
+static int  store_hole_map(fs_t fs);
+static bool is_hole_block(fs_t fs, int block);
+static void set_hole_block(fs_t fs, int block, bool is_hole);
+static int  read_data_block(fs_t fs, int block, char *buf);
+static int  import_blocks(fs_t fs, int file_index, size_t offset, int host_fd, size_t count);
+static int  import_buffered(fs_t fs, int file_index, size_t offset, int host_fd, size_t count, int flags);
+static int  export_buffered(fs_t fs, struct rootdirectory_t *the_dir, size_t offset, int host_fd, size_t count);
+static int  export_blocks(fs_t fs, struct rootdirectory_t *the_dir, size_t offset, int host_fd, size_t count);
+static int  write_host(int host_fd, const char *buf, size_t count);
+static void init_locks(fs_t fs);
+static void destroy_locks(fs_t fs);
+static void lock_fd_file(fs_t fs, int fd, bool is_writer);
+static void unlock_fd_file(fs_t fs, int fd);
+
+
+fs_t fs_alloc(void) {
+
+	return calloc(1, sizeof(struct fs));
+}
+
+
+int fs_free(fs_t fs) {
+
+	if(!fs || fs->disk) {
+		fs_error("instance still mounted \n");
+		return -1;
+	}
+
+	free(fs);
+	return 0;
+}
+
+
+fs_t fs_default(void) {
+
+	return &default_fs;
+}
 
 
 // Makes the file system contained in the specified virtual disk "ready to be used"
-int fs_mount(const char *diskname) {
+int fs_mount_r(fs_t fs, const char *diskname) {
 
-	superblock = malloc(BLOCK_SIZE);
+	PREEMPT_DISABLE_SCOPE();
+
+	if(fs->disk) {
+		fs_error("disk already open \n");
+		return -1;
+	}
+
+	// whatever got set up is undone on failure, so nothing is left over
+	// from a previous mount of the instance
+	bool has_locks = false;
+	fs->superblock     = NULL;
+	fs->FAT_blocks     = NULL;
+	fs->root_dir_block = NULL;
+	fs->block_cache    = NULL;
+	fs->chunk_cache    = NULL;
+	fs->hole_map       = NULL;
+	fs->block_refs     = NULL;
+	fs->block_hashes   = NULL;
+	fs->hash_next      = NULL;
+	fs->hash_buckets   = NULL;
+
+	fs->superblock = malloc(BLOCK_SIZE);
+	if(!fs->superblock) {
+		fs_error("failure to allocate the superblock \n");
+		return -1;
+	}
 
 	// open disk dd
-	if(block_disk_open(diskname) < 0){
+	fs->disk = block_disk_open_r(diskname);
+	if(!fs->disk){
 		fs_error("failure to open virtual disk \n");
-		return -1;
+		goto fail;
 	}
 	
 	// initialize data onto local super block 
-	if(block_read(0, (void*)superblock) < 0){
+	if(block_read_r(fs->disk, 0, (void*)fs->superblock) < 0){
 		fs_error( "failure to read from block \n");
-		return -1;
+		goto fail;
 	}
 	// check for correct signature
-	if(strncmp(superblock->signature, "ECS150FS", 8) != 0){
+	if(strncmp(fs->superblock->signature, "ECS150FS", 8) != 0){
 		fs_error( "invalid disk signature \n");
-		return -1;
+		goto fail;
 	}
 	// check for correct number of blocks on disk
-	if(superblock->num_blocks != block_disk_count()) {
+	if(fs->superblock->num_blocks != block_disk_count_r(fs->disk)) {
 		fs_error("incorrect block disk count \n");
-		return -1;
+		goto fail;
 	}
 
 	// initialize data onto local FAT blocks
-	FAT_blocks = malloc(superblock->num_FAT_blocks * BLOCK_SIZE);
-	for(int i = 0; i < superblock->num_FAT_blocks; i++) {
+	fs->FAT_blocks = malloc(fs->superblock->num_FAT_blocks * BLOCK_SIZE);
+	if(!fs->FAT_blocks) {
+		fs_error("failure to allocate the FAT \n");
+		goto fail;
+	}
+	for(int i = 0; i < fs->superblock->num_FAT_blocks; i++) {
 		// read each fat block in the disk starting at position 1
-		if(block_read(i + 1, (void*)FAT_blocks + (i * BLOCK_SIZE)) < 0) {
+		if(block_read_r(fs->disk, i + 1, (void*)fs->FAT_blocks + (i * BLOCK_SIZE)) < 0) {
 			fs_error("failure to read from block \n");
-			return -1;
+			goto fail;
 		}
 	}
 
 	// initialize data onto local root directory block
-	root_dir_block = malloc(sizeof(struct rootdirectory_t) * FS_FILE_MAX_COUNT);
+	fs->root_dir_block = malloc(sizeof(struct rootdirectory_t) * FS_FILE_MAX_COUNT);
+	if(!fs->root_dir_block) {
+		fs_error("failure to allocate the root directory \n");
+		goto fail;
+	}
 	// read the root directory block in the disk starting after the last FAT block
-	if(block_read(superblock->num_FAT_blocks + 1, (void*)root_dir_block) < 0) { 
+	if(block_read_r(fs->disk, fs->superblock->num_FAT_blocks + 1, (void*)fs->root_dir_block) < 0) { 
 		fs_error("failure to read from block \n");
-		return -1;
+		goto fail;
 	}
 	
 	// initialize file descriptors 
     for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		fd_table[i].is_used = false;
+		fs->fd_table[i].is_used = false;
+	}
+
+	// chains get walked lazily, on first use
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		fs->chain_cache[i].is_valid = false;
+	}
+	fs->first_free_block = 1;
+	fs->num_free_blocks = 0;
+	for(int i = 1; i < fs->superblock->num_data_blocks; i++) {
+		if(fs->FAT_blocks[i].words == EMPTY)
+			fs->num_free_blocks++;
+	}
+
+	// start with empty buffer and chunk caches
+	fs->block_cache = calloc(CACHE_NUM_SLOTS, sizeof(struct cache_slot_t));
+	fs->chunk_cache = calloc(CHUNK_CACHE_NUM_SLOTS, sizeof(struct chunk_slot_t));
+	if(!fs->block_cache || !fs->chunk_cache) {
+		fs_error("failure to allocate the caches \n");
+		goto fail;
+	}
+	init_locks(fs);
+	init_pools(fs);
+	has_locks = true;
+
+	// holes of sparse files, if any
+	if(load_hole_map(fs) < 0) {
+		fs_error("failure to read holes \n");
+		goto fail;
+	}
+
+	// reference counts of shared blocks, if any
+	if(load_block_refs(fs) < 0) {
+		fs_error("failure to read block reference counts \n");
+		goto fail;
+	}
+
+	// hashes of the blocks written in dedup mode, if any
+	if(load_dedup_table(fs) < 0) {
+		fs_error("failure to read block hashes \n");
+		goto fail;
+	}
+
+	// snapshots get loaded when mounted, the live files are visible first
+	for(int i = 0; i < FS_SNAPSHOT_MAX_COUNT; i++) {
+		fs->snapshot_dirs[i] = NULL;
 	}
+	fs->view_dir      = fs->root_dir_block;
+	fs->view_snapshot = FS_SNAPSHOT_LIVE;
         
 	return 0;
+
+fail:
+	free(fs->hash_buckets);
+	free(fs->hash_next);
+	free(fs->block_hashes);
+	free(fs->block_refs);
+	free(fs->hole_map);
+	if(has_locks) {
+		destroy_pools(fs);
+		destroy_locks(fs);
+	}
+	free(fs->chunk_cache);
+	free(fs->block_cache);
+	free(fs->root_dir_block);
+	free(fs->FAT_blocks);
+	if(fs->disk)
+		block_disk_close_r(fs->disk);
+	free(fs->superblock);
+	fs->superblock = NULL;
+	fs->disk = NULL;
+	return -1;
 }
 
 
 // Makes sure that the virtual disk is properly closed and that all the internal data structures of the FS layer are properly cleaned.
-int fs_umount(void) {
+int fs_umount_r(fs_t fs) {
 
-	if(!superblock){
+	PREEMPT_DISABLE_SCOPE();
+
+	if(!fs->superblock){
 		fs_error("No disk available to unmount\n");
 		return -1;
 	}
 
-	if(block_write(0, (void*)superblock) < 0) {
+	// save the reference counts of shared blocks, the block hashes and the
+	// holes, then write back the data blocks still dirty in the cache
+	if(store_block_refs(fs) < 0 || store_dedup_table(fs) < 0 ||
+	   store_hole_map(fs) < 0 || cache_flush(fs) < 0) {
+		fs_error("failure to write to block \n");
+		return -1;
+	}
+
+	// blocks still reserved by the threads are free on disk
+	destroy_pools(fs);
+
+	if(block_write_r(fs->disk, 0, (void*)fs->superblock) < 0) {
 		fs_error("failure to write to block \n");
 		return -1;
 	}
 
-	for(int i = 0; i < superblock->num_FAT_blocks; i++) {
-		if(block_write(i + 1, (void*)FAT_blocks + (i * BLOCK_SIZE)) < 0) {
+	for(int i = 0; i < fs->superblock->num_FAT_blocks; i++) {
+		if(block_write_r(fs->disk, i + 1, (void*)fs->FAT_blocks + (i * BLOCK_SIZE)) < 0) {
 			fs_error("failure to write to block \n");
 			return -1;
 		}
 	}
 
-	if(block_write(superblock->num_FAT_blocks + 1, (void*)root_dir_block) < 0) {
+	if(block_write_r(fs->disk, fs->superblock->num_FAT_blocks + 1, (void*)fs->root_dir_block) < 0) {
 		fs_error("failure to write to block \n");
 			return -1;
 	}
 
-	free(superblock);
-	free(root_dir_block);
-	free(FAT_blocks);
+	destroy_locks(fs);
+	free(fs->superblock);
+	free(fs->root_dir_block);
+	free(fs->FAT_blocks);
+	free(fs->block_cache);
+	free(fs->chunk_cache);
+	free(fs->block_refs);
+	free(fs->block_hashes);
+	free(fs->hash_buckets);
+	free(fs->hash_next);
+	free(fs->hole_map);
+	for(int i = 0; i < FS_SNAPSHOT_MAX_COUNT; i++) {
+		free(fs->snapshot_dirs[i]);
+	}
+	fs->superblock = NULL;
 
 	// reset file descriptors
     for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		fd_table[i].offset = 0;
-		fd_table[i].is_used = false;
-		fd_table[i].file_index = -1;
-		memset(fd_table[i].file_name, 0, FS_FILENAME_LEN);
+		fs->fd_table[i].offset = 0;
+		fs->fd_table[i].is_used = false;
+		fs->fd_table[i].file_index = -1;
+		fs->fd_table[i].flags = 0;
+		memset(fs->fd_table[i].file_name, 0, FS_FILENAME_LEN);
     }
 
-	block_disk_close();
+	block_disk_close_r(fs->disk);
+	fs->disk = NULL;
 	return 0;
 }
 
 
 // Display some information about the currently mounted file system.
-int fs_info(void) {
+int fs_info_r(fs_t fs) {
+
+	PREEMPT_DISABLE_SCOPE();
 
+	pthread_rwlock_rdlock(&fs->dir_lock);
 	printf("FS Info:\n");
-	printf("total_blk_count=%d\n", superblock->num_blocks);
-	printf("fat_blk_count=%d\n", superblock->num_FAT_blocks);
-	printf("rdir_blk=%d\n", superblock->num_FAT_blocks + 1);
-	printf("data_blk=%d\n", superblock->num_FAT_blocks + 2);
-	printf("data_blk_count=%d\n", superblock->num_data_blocks);
-	printf("fat_free_ratio=%d/%d\n", get_num_FAT_free_blocks(), superblock->num_data_blocks);
-	printf("rdir_free_ratio=%d/128\n", count_num_open_dir());
+	printf("total_blk_count=%d\n", fs->superblock->num_blocks);
+	printf("fat_blk_count=%d\n", fs->superblock->num_FAT_blocks);
+	printf("rdir_blk=%d\n", fs->superblock->num_FAT_blocks + 1);
+	printf("data_blk=%d\n", fs->superblock->num_FAT_blocks + 2);
+	printf("data_blk_count=%d\n", fs->superblock->num_data_blocks);
+	printf("fat_free_ratio=%d/%d\n", get_num_FAT_free_blocks(fs), fs->superblock->num_data_blocks);
+	printf("rdir_free_ratio=%d/128\n", count_num_open_dir(fs));
+	pthread_rwlock_unlock(&fs->dir_lock);
 
 	return 0;
 }
@@ -216,70 +661,65 @@ Create a new file:
 	2. The name needs to be set, and all other information needs to get reset.
 		2.2 Intitially the size is 0 and pointer to first data block is FAT_EOC.
 */
-int fs_create(const char *filename) {
+int fs_create_r(fs_t fs, const char *filename) {
+
+	PREEMPT_DISABLE_SCOPE();
+
+	pthread_rwlock_wrlock(&fs->dir_lock);
 
 	// perform error checking first 
-	if(error_free(filename) == false) {
+	if(!is_live_view(fs) || is_sysfile_name(filename) || error_free(fs, filename) == false) {
+		pthread_rwlock_unlock(&fs->dir_lock);
 		fs_error("error associated with filename");
 		return -1;
 	}
 
-	// finds first available empty file
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if(root_dir_block[i].filename[0] == EMPTY) {	
-
-			// initialize file data 
-			strcpy(root_dir_block[i].filename, filename);
-			root_dir_block[i].file_size     = 0;
-			root_dir_block[i].start_data_block = EOC;
-
-			return 0;
-		}
-	}
-	return -1;
+	int file_index = create_entry(fs, filename);
+	pthread_rwlock_unlock(&fs->dir_lock);
+	return file_index == -1 ? -1 : 0;
 }
 
 
 /*
 Remove File:
 	1. Empty file entry and all its datablocks associated with file contents from FAT.
-	2. Free associated data blocks
+	2. Free associated data blocks, up to the first block still shared
+	   with another file.
 */
-int fs_delete(const char *filename) {
+int fs_delete_r(fs_t fs, const char *filename) {
+
+	PREEMPT_DISABLE_SCOPE();
+
 	
-	if (is_open(filename)) {
+	pthread_rwlock_wrlock(&fs->dir_lock);
+	if (!is_live_view(fs) || is_sysfile_name(filename) || is_open(fs, filename)) {
+		pthread_rwlock_unlock(&fs->dir_lock);
 		fs_error("file currently open");
 		return -1;
 	}
 
-	int file_index = locate_file(filename);
-	struct rootdirectory_t* the_dir = &root_dir_block[file_index]; 
-	int frst_dta_blk_i = the_dir->start_data_block;
-
-	while (frst_dta_blk_i != EOC) {
-		uint16_t tmp = FAT_blocks[frst_dta_blk_i].words;
-		FAT_blocks[frst_dta_blk_i].words = EMPTY;
-		frst_dta_blk_i = tmp;
-	}
-
-	// reset file to blank slate
-	memset(the_dir->filename, 0, FS_FILENAME_LEN);
-	the_dir->file_size = 0;
+	remove_entry(fs, locate_file(fs, filename));
+	pthread_rwlock_unlock(&fs->dir_lock);
 
 	return 0;
 }
 
 
-int fs_ls(void) {
+int fs_ls_r(fs_t fs) {
 
+	PREEMPT_DISABLE_SCOPE();
+
+	pthread_rwlock_rdlock(&fs->dir_lock);
 	printf("FS Ls:\n");
-	// finds first available file block in root dir 
+	// finds first available file block in root dir (or mounted snapshot)
 	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if(root_dir_block[i].filename[0] != 0x00) {
-			printf("file: %s, size: %d, ", root_dir_block[i].filename, root_dir_block[i].file_size);
-			printf("data_blk: %d\n", root_dir_block[i].start_data_block);
+		if(fs->view_dir[i].filename[0] != 0x00 &&
+		   !is_sysfile_name(fs->view_dir[i].filename)) {
+			printf("file: %s, size: %d, ", fs->view_dir[i].filename, fs->view_dir[i].file_size);
+			printf("data_blk: %d\n", fs->view_dir[i].start_data_block);
 		}
 	}	
+	pthread_rwlock_unlock(&fs->dir_lock);
 
 	return 0;
 }
@@ -294,25 +734,57 @@ Open and return FD:
 		2.2 Increment number of file scriptors to of requested file object
 	3. Return file descriptor index, or other wise -1 on failure
 */
-int fs_open(const char *filename) {
+int fs_open_r(fs_t fs, const char *filename) {
 
-    int file_index = locate_file(filename);
-    if(file_index == -1) { 
+	return fs_open_flags_r(fs, filename, 0);
+}
+
+
+// Same as fs_open, but remembers the open flags in the file descriptor
+int fs_open_flags_r(fs_t fs, const char *filename, int flags) {
+
+	PREEMPT_DISABLE_SCOPE();
+
+	if (flags & ~(FS_O_APPEND | FS_O_COMPRESS | FS_O_DEDUP)) {
+		fs_error("unknown open flags [0x%x]\n", flags);
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&fs->dir_lock);
+    int file_index = locate_file_in(fs->view_dir, filename);
+    if(file_index == -1 || is_sysfile_name(filename)) { 
+		pthread_rwlock_unlock(&fs->dir_lock);
         fs_error("file @[%s] doesnt exist\n", filename);
         return -1;
     } 
 
-    int fd = locate_avail_fd();
+	pthread_mutex_lock(&fs->fd_lock);
+    int fd = locate_avail_fd(fs);
+    if (fd != -1)
+		fs->fd_table[fd].is_used = true;
+	pthread_mutex_unlock(&fs->fd_lock);
     if (fd == -1){
+		pthread_rwlock_unlock(&fs->dir_lock);
 		fs_error("max file descriptors already allocated\n");
         return -1;
     }
 
-	fd_table[fd].is_used    = true;
-	fd_table[fd].file_index = file_index;
-	fd_table[fd].offset     = 0;
+	fs->fd_table[fd].file_index = file_index;
+	fs->fd_table[fd].offset     = 0;
+	fs->fd_table[fd].flags      = flags;
+	fs->fd_table[fd].dir        = fs->view_dir;
 	
-	strcpy(fd_table[fd].file_name, filename); 
+	strcpy(fs->fd_table[fd].file_name, filename); 
+
+	// an empty live file can switch to compressed storage
+	struct rootdirectory_t *the_dir = &fs->view_dir[file_index];
+	if ((flags & FS_O_COMPRESS) && fs->view_dir == fs->root_dir_block) {
+		pthread_rwlock_wrlock(&fs->file_locks[file_index]);
+		if (the_dir->start_data_block == EOC)
+			the_dir->flags |= FILE_COMPRESSED;
+		pthread_rwlock_unlock(&fs->file_locks[file_index]);
+	}
+	pthread_rwlock_unlock(&fs->dir_lock);
 
     return fd;
 }
@@ -323,24 +795,44 @@ Close FD object:
 	1. Check that it is a valid FD
 	2. Locate file descriptor object, given its index
 	3. Locate its the associated filename of the fd and decrement its fd
-	4. Mark FD as available for use
+	4. In dedup mode, share the end of the file with identical blocks
+	5. Mark FD as available for use
 */
-int fs_close(int fd) {
+int fs_close_r(fs_t fs, int fd) {
+
+	PREEMPT_DISABLE_SCOPE();
 
-    if(fd >= FS_OPEN_MAX_COUNT || fd < 0 || fd_table[fd].is_used == 0) {
+    if(fd >= FS_OPEN_MAX_COUNT || fd < 0 || fs->fd_table[fd].is_used == 0) {
 		fs_error("invalid file descriptor supplied \n");
         return -1;
     }
 
-    struct file_descriptor_t *fd_obj = &fd_table[fd];
+    struct file_descriptor_t *fd_obj = &fs->fd_table[fd];
 
-    int file_index = locate_file(fd_obj->file_name);
+	// dedup mode looks into the chains of all the other files
+	bool is_dedup = (fd_obj->flags & FS_O_DEDUP) && fd_obj->dir == fs->root_dir_block;
+	if (is_dedup)
+		pthread_rwlock_wrlock(&fs->dir_lock);
+	else
+		pthread_rwlock_rdlock(&fs->dir_lock);
+
+    int file_index = locate_file_in(fd_obj->dir, fd_obj->file_name);
     if(file_index == -1) { 
+		pthread_rwlock_unlock(&fs->dir_lock);
         fs_error("file @[%s] doesnt exist\n", fd_obj->file_name);
         return -1;
     } 
 
+	if (is_dedup && !(fs->root_dir_block[file_index].flags & FILE_COMPRESSED))
+		dedup_chain(fs, file_index);
+
+	pthread_mutex_lock(&fs->fd_lock);
     fd_obj->is_used = false;
+	pthread_mutex_unlock(&fs->fd_lock);
+	pthread_rwlock_unlock(&fs->dir_lock);
+
+	// done writing for now, the blocks reserved by the thread are not kept
+	release_pool(fs);
 
 	return 0;
 }
@@ -352,243 +844,707 @@ Return the size of the file corresponding to the specified file descriptor.
 	2. Locate file from root dir from fd
 	3. Return file size from appropriate root dir 
 */
-int fs_stat(int fd) {
-    if(fd >= FS_OPEN_MAX_COUNT || fd < 0 || fd_table[fd].is_used == false) {
+int fs_stat_r(fs_t fs, int fd) {
+
+	PREEMPT_DISABLE_SCOPE();
+
+    if(fd >= FS_OPEN_MAX_COUNT || fd < 0 || fs->fd_table[fd].is_used == false) {
 		fs_error("invalid file descriptor supplied \n");
         return -1;
     }
 
-    struct file_descriptor_t *fd_obj = &fd_table[fd];
-
-    int file_index = locate_file(fd_obj->file_name);
-    if(file_index == -1) { 
-        fs_error("file @[%s] doesnt exist\n", fd_obj->file_name);
-        return -1;
-    } 
+    struct file_descriptor_t *fd_obj = &fs->fd_table[fd];
 
-	return root_dir_block[file_index].file_size;
+	pthread_rwlock_rdlock(&fs->dir_lock);
+	int file_size = fd_obj->dir[fd_obj->file_index].file_size;
+	pthread_rwlock_unlock(&fs->dir_lock);
+	return file_size;
 }
 
 /*
 Move supplied fd to supplied offset
-	1. Make sure the offset is valid: cannot be less than zero, nor can 
-	   it exceed the size of the file itself.
-	2. Error check 
-	3. Update offset of fd
+	1. Error check 
+	2. Update offset of fd. It may go past the end of the file, writing
+	   there leaves a hole.
 */
-int fs_lseek(int fd, size_t offset) {
-	struct file_descriptor_t *fd_obj = &fd_table[fd];
-    int file_index = locate_file(fd_obj->file_name);
-    if(file_index == -1) { 
-        fs_error("file @[%s] doesnt exist\n", fd_obj->file_name);
-        return -1;
-    } 
+int fs_lseek_r(fs_t fs, int fd, size_t offset) {
 
-	int32_t file_size = fs_stat(fd);
-	
-	if (offset < 0 || offset > file_size) {
-        fs_error("file @[%s] is out of bounds \n", fd_obj->file_name);
-        return -1;
-	} else if (fd_table[fd].is_used == false) {
-        fs_error("invalid file descriptor [%s] \n", fd_obj->file_name);
-        return -1;
-	} 
+	PREEMPT_DISABLE_SCOPE();
 
-	fd_table[fd].offset = offset;
+	int32_t file_size = fs_stat_r(fs, fd);
+	if (file_size == -1)
+		return -1;
+
+	fs->fd_table[fd].offset = offset;
 	return 0;
 }
 
-// Write to a file:
-int fs_write(int fd, void *buf, size_t count) {
-	// Error Checking 
-	if (count <= 0) {
-        fs_error("request nbytes amount is trivial" );
-        return -1;
-	} else if (fd <= -1 || fd >= FS_OPEN_MAX_COUNT) {
-        fs_error("invalid file descriptor [%d] \n", fd);
-        return -1;
-	} else if (get_num_FAT_free_blocks() == EMPTY) {
-        fs_error("no free entries to write to");
-        return -1;
-	} else if (fd_table[fd].is_used == false) {
-        fs_error("file descriptor is not open");
-        return -1;
-	}
-
-	// find relative information about file 
-	char *file_name = fd_table[fd].file_name;				
-	int file_index = locate_file(file_name);				
-	int offset = fd_table[fd].offset;						
-
-	struct rootdirectory_t *the_dir = &root_dir_block[file_index];	
+/*
+Write to a file:
+	1. Error check the file descriptor and the amount to write.
+	2. Descriptors opened with FS_O_APPEND always write at the end of the file.
+	3. Write at the offset of the file descriptor, and move it past the
+	   written bytes.
+*/
+int fs_write_r(fs_t fs, int fd, void *buf, size_t count) {
 
-	int num_blocks = ((count + (offset % BLOCK_SIZE)) / BLOCK_SIZE) + 1; 
-	int cur_block = offset/BLOCK_SIZE;					
-	int curr_fat_index = the_dir->start_data_block;
+	PREEMPT_DISABLE_SCOPE();
 
-	// find the extra blocks required for writing count 
-	// amount of bytes from buffer 
- 	int extra_blocks;
- 	if(the_dir->file_size != 0) {
-		int file_width = the_dir->file_size / BLOCK_SIZE;
-		int block_difference = offset + num_blocks * BLOCK_SIZE;
-		extra_blocks = (block_difference / BLOCK_SIZE) - 1;
-		extra_blocks = extra_blocks - file_width;
-	}
-	else extra_blocks = num_blocks;
+	return write_fd(fs, fd, buf, count, 0, false);
+}
+int fs_pwrite_r(fs_t fs, int fd, void *buf, size_t count, size_t offset) {
 
-	// set up information for iterating through blocks
-	char *write_buf = (char*)buf;
-	char bounce_buff[BLOCK_SIZE];
-	
-	int amount_to_write = count;
-	int left_shift;
-	int total_byte_written = 0;
-	int location = offset % BLOCK_SIZE;
+	PREEMPT_DISABLE_SCOPE();
 
-	// get to starting block 
-	curr_fat_index = go_to_cur_FAT_block(curr_fat_index, cur_block);
+	return write_fd(fs, fd, buf, count, offset, true);
+}
 
-	int available_data_blocks = 0;
-	int fat_block_indices[extra_blocks];
 
-	// locate and store indices of the free blocks
-	// to avoid overwriting other file contents
-	for(int j = 0; j < superblock->num_data_blocks; j++){
-		if(FAT_blocks[j].words == 0){
-			fat_block_indices[available_data_blocks] = j;
-			available_data_blocks++;
-		}
-		if(available_data_blocks == extra_blocks)
-			break;
-	}
+/*
+Read a File:
+	1. Error check that the amount to be read is > 0, and that the
+	   the file descriptor is valid.
+	2. Read at the offset of the file descriptor, and move it past the
+	   read bytes.
+*/
+int fs_read_r(fs_t fs, int fd, void *buf, size_t count) {
 
-	// for the case where there are no more availabe data blocks on disk
-	num_blocks = available_data_blocks; 
+	PREEMPT_DISABLE_SCOPE();
 
-	// extending the fat table for a file when it already
-	// contains data 
-	if(the_dir->start_data_block == EOC) { 
-		curr_fat_index = fat_block_indices[0];
-		the_dir->start_data_block = curr_fat_index;
-	}
-	else {
-		int frst_dta_blk_i = the_dir->start_data_block;
-		while(frst_dta_blk_i != EOC){
-			frst_dta_blk_i = FAT_blocks[frst_dta_blk_i].words;
-		}
-		for(int k =0; k < num_blocks; k++){
-			FAT_blocks[frst_dta_blk_i].words = fat_block_indices[k];
-			frst_dta_blk_i = FAT_blocks[frst_dta_blk_i].words;
-		}
-		FAT_blocks[frst_dta_blk_i].words = EOC;
-	}
+	return read_fd(fs, fd, buf, count, 0, false);
+}
+int fs_pread_r(fs_t fs, int fd, void *buf, size_t count, size_t offset) {
 
-	num_blocks = ((count + (offset % BLOCK_SIZE)) / BLOCK_SIZE) + 1;
+	PREEMPT_DISABLE_SCOPE();
 
-	// write to the disk as much as we can (dont overload the disk)
-	int num_free = get_num_FAT_free_blocks();
-	if (num_blocks > num_free) {
-		num_blocks = num_free;
-	}
+	return read_fd(fs, fd, buf, count, offset, true);
+}
 
-	// main iteration loop for writing block per block
-	for (int i = 0; i < num_blocks; i++) {
-		if (location + amount_to_write > BLOCK_SIZE) {
-			left_shift = BLOCK_SIZE - location;
-		} else {
-			left_shift = amount_to_write;
-		}
 
-		memcpy(bounce_buff + location, write_buf, left_shift);
-		block_write(curr_fat_index + superblock->data_start_index, (void*)bounce_buff);
-		
-		// position array to left block 
-		total_byte_written += left_shift;
-		write_buf += left_shift;
+/*
+Import into a file from a host file:
+	1. Error check the file descriptor, like fs_write.
+	2. Copy the partial first block through a buffer.
+	3. Copy the whole blocks from the host file straight to the physically
+	   contiguous runs of the chain, in the kernel.
+	4. Copy the rest through a buffer, and all of the data for the files
+	   which need it in memory (compressed files, dedup mode).
+*/
+int fs_import_r(fs_t fs, int fd, int host_fd, size_t count) {
 
-		location= 0;
-		amount_to_write -= left_shift;
+	PREEMPT_DISABLE_SCOPE();
 
-		// updating the final FAT entry values 
-		if(i < num_blocks - 1){
-			FAT_blocks[curr_fat_index].words = fat_block_indices[i+1];
-			curr_fat_index = FAT_blocks[curr_fat_index].words;
-		}
-		else{
-			FAT_blocks[curr_fat_index].words = EOC;
-			curr_fat_index = FAT_blocks[curr_fat_index].words;
-		}
+	if (fd <= -1 || fd >= FS_OPEN_MAX_COUNT || fs->fd_table[fd].is_used == false) {
+        fs_error("invalid file descriptor [%d] \n", fd);
+        return -1;
+	} else if (fs->fd_table[fd].dir != fs->root_dir_block) {
+        fs_error("file descriptor belongs to a read-only snapshot");
+        return -1;
 	}
 
-	// update filesize accordingly to how much was written 
-	if(offset + total_byte_written > the_dir->file_size){
-		the_dir->file_size = offset + total_byte_written;
+	int file_index = fs->fd_table[fd].file_index;
+	int flags = fs->fd_table[fd].flags;
+	lock_fd_file(fs, fd, true);
+
+	size_t offset = fs->fd_table[fd].offset;
+	if (flags & FS_O_APPEND)
+		offset = fs->root_dir_block[file_index].file_size;
+
+	size_t total_byte_written = 0;
+	if (!(fs->root_dir_block[file_index].flags & FILE_COMPRESSED) &&
+	    !(flags & FS_O_DEDUP)) {
+		size_t head = (BLOCK_SIZE - offset % BLOCK_SIZE) % BLOCK_SIZE;
+		if (head > count)
+			head = count;
+		total_byte_written = import_buffered(fs, file_index, offset, host_fd, head, flags);
+
+		size_t whole = (count - total_byte_written) / BLOCK_SIZE * BLOCK_SIZE;
+		if (total_byte_written == head && whole > 0) {
+			int imported = import_blocks(fs, file_index, offset + head, host_fd, whole);
+			total_byte_written += imported;
+			if (imported < whole)
+				count = total_byte_written;
+		}
 	}
+	if (total_byte_written < count)
+		total_byte_written += import_buffered(fs, file_index, offset + total_byte_written,
+						      host_fd, count - total_byte_written, flags);
+	unlock_fd_file(fs, fd);
 
-	fd_table[fd].offset += total_byte_written;
+	fs->fd_table[fd].offset = offset + total_byte_written;
 	return total_byte_written;
 }
 
 
 /*
-Read a File:
-	1. Error check that the amount to be read is > 0, and that the
-	   the file descriptor is valid.
+Export from a file to a host file:
+	1. Error check the file descriptor, like fs_read.
+	2. Write back the dirty cached blocks, so that the disk is up to date.
+	3. Copy the physically contiguous runs of the chain straight to the
+	   host file, in the kernel. Holes are written as zeros.
+	4. Compressed files are decompressed in memory.
 */
-int fs_read(int fd, void *buf, size_t count) {
-	
-	// error check 
-    if(fd_table[fd].is_used == false || 
-	   fd >= FS_OPEN_MAX_COUNT) {
+int fs_export_r(fs_t fs, int fd, int host_fd, size_t count) {
+
+	PREEMPT_DISABLE_SCOPE();
+
+    if(fd < 0 || fd >= FS_OPEN_MAX_COUNT || fs->fd_table[fd].is_used == false) {
 		fs_error("invalid file descriptor [%d]", fd);
         return -1;
-    } else if (count <= 0) {
-		fs_error("request nbyte amount is trivial");
+    }
+
+	struct rootdirectory_t *the_dir = &fs->fd_table[fd].dir[fs->fd_table[fd].file_index];
+	size_t offset = fs->fd_table[fd].offset;
+
+	lock_fd_file(fs, fd, false);
+	int total_bytes_read;
+	if (the_dir->flags & FILE_COMPRESSED)
+		total_bytes_read = export_buffered(fs, the_dir, offset, host_fd, count);
+	else
+		total_bytes_read = export_blocks(fs, the_dir, offset, host_fd, count);
+	unlock_fd_file(fs, fd);
+	if (total_bytes_read < 0)
 		return -1;
-	} 
 
-	// gather nessessary information 
-	char *file_name = fd_table[fd].file_name;
-	int file_index = locate_file(file_name);
-	size_t offset = fd_table[fd].offset;
-	
-	struct rootdirectory_t *the_dir = &root_dir_block[file_index];
+	fs->fd_table[fd].offset += total_bytes_read;
+	return total_bytes_read;
+}
 
 
-	// check if offset of file exceeds the file_size
-	int amount_to_read = 0;
-	if (offset + count > the_dir->file_size) 
-		amount_to_read = abs(the_dir->file_size - offset);
-	else amount_to_read = count;
+/*
+Clone a file:
+	1. Create the destination file.
+	2. Make it point to the chain of the source file, and count the extra
+	   reference on the first data block. The rest of the chain is
+	   referenced through the shared first block.
+	3. Blocks are copied later, by file_write_at, when either file modifies
+	   them.
+*/
+int fs_clone_r(fs_t fs, const char *src, const char *dst) {
 
-	char *read_buf = (char *)buf;
-	int16_t FAT_iter = the_dir->start_data_block;
-	size_t num_blocks = (amount_to_read / BLOCK_SIZE) + 1;
-	
-	// block level
-	int cur_block = offset / BLOCK_SIZE; 
+	PREEMPT_DISABLE_SCOPE();
 
-	// byte level
-	int location= offset % BLOCK_SIZE;
-	char bounce_buff[BLOCK_SIZE];
-		
-	// go to correct current block in fat entry
-	FAT_iter = go_to_cur_FAT_block(FAT_iter, cur_block);
+	pthread_rwlock_wrlock(&fs->dir_lock);
+	int ret = -1;
 
-	// read through the number of blocks it contains
-	int left_shift = 0;
-	int total_bytes_read = 0;
-	for (int i = 0; i < num_blocks; i++) {
-		if (location+ amount_to_read > BLOCK_SIZE) {
+	if (!is_live_view(fs)) {
+		fs_error("snapshot mounted read-only");
+		goto out;
+	}
+
+	int src_index = locate_file(fs, src);
+	if (src_index == -1 || is_sysfile_name(src)) {
+		fs_error("file @[%s] doesnt exist\n", src);
+		goto out;
+	}
+
+	if (is_sysfile_name(dst) || error_free(fs, dst) == false) {
+		fs_error("error associated with filename");
+		goto out;
+	}
+
+	int dst_index = create_entry(fs, dst);
+	if (dst_index == -1)
+		goto out;
+
+	struct rootdirectory_t *src_dir = &fs->root_dir_block[src_index];
+	struct rootdirectory_t *dst_dir = &fs->root_dir_block[dst_index];
+
+	dst_dir->file_size        = src_dir->file_size;
+	dst_dir->start_data_block = src_dir->start_data_block;
+	dst_dir->flags            = src_dir->flags;
+	if (dst_dir->start_data_block != EOC)
+		fs->block_refs[dst_dir->start_data_block]++;
+
+	load_chain_cache(fs, src_index);
+	if (dst_dir->start_data_block != EOC)
+		fs->chain_cache[src_index].may_share = true;
+	fs->chain_cache[dst_index] = fs->chain_cache[src_index];
+
+	ret = 0;
+out:
+	pthread_rwlock_unlock(&fs->dir_lock);
+	return ret;
+}
+
+
+/*
+Create a snapshot:
+	1. Find a free snapshot number.
+	2. Freeze a copy of the root directory, without the system files.
+	3. Count one more reference on the first data block of every file.
+	4. Save the copy in its system file.
+*/
+int fs_snapshot_create_r(fs_t fs) {
+
+	PREEMPT_DISABLE_SCOPE();
+
+	pthread_rwlock_wrlock(&fs->dir_lock);
+	int ret = -1;
+
+	if (!is_live_view(fs)) {
+		fs_error("snapshot mounted read-only");
+		goto out;
+	}
+
+	int snapshot;
+	char snapshot_name[FS_FILENAME_LEN];
+	for (snapshot = 0; snapshot < FS_SNAPSHOT_MAX_COUNT; snapshot++) {
+		snprintf(snapshot_name, FS_FILENAME_LEN, SNAPSHOT_FILE, snapshot);
+		if (locate_file(fs, snapshot_name) == -1)
+			break;
+	}
+	if (snapshot == FS_SNAPSHOT_MAX_COUNT) {
+		fs_error("all snapshots are taken");
+		goto out;
+	}
+
+	struct rootdirectory_t *frozen_dir = malloc(BLOCK_SIZE);
+	if (frozen_dir == NULL)
+		goto out;
+	memcpy(frozen_dir, fs->root_dir_block, BLOCK_SIZE);
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (is_sysfile_name(frozen_dir[i].filename))
+			memset(&frozen_dir[i], 0, sizeof(struct rootdirectory_t));
+	}
+
+	int file_index = create_entry(fs, snapshot_name);
+	if (file_index == -1 ||
+	    file_write_at(fs, file_index, 0, frozen_dir, BLOCK_SIZE, 0) != BLOCK_SIZE) {
+		if (file_index != -1)
+			remove_entry(fs, file_index);
+		free(frozen_dir);
+		fs_error("no space left for snapshot");
+		goto out;
+	}
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (frozen_dir[i].filename[0] != EMPTY &&
+		    frozen_dir[i].start_data_block != EOC) {
+			fs->block_refs[frozen_dir[i].start_data_block]++;
+			fs->chain_cache[i].may_share = true;
+		}
+	}
+
+	fs->snapshot_dirs[snapshot] = frozen_dir;
+	ret = snapshot;
+out:
+	pthread_rwlock_unlock(&fs->dir_lock);
+	return ret;
+}
+
+
+/*
+Mount a snapshot:
+	1. Load the frozen root directory of the snapshot, if needed.
+	2. Use it for fs_open and fs_ls, until another snapshot (or the live
+	   file system) gets mounted. Files which are already open stay open on
+	   their own version.
+*/
+int fs_snapshot_mount_r(fs_t fs, int snapshot) {
+
+	PREEMPT_DISABLE_SCOPE();
+
+	pthread_rwlock_wrlock(&fs->dir_lock);
+	int ret = -1;
+
+	if (snapshot == FS_SNAPSHOT_LIVE) {
+		fs->view_dir      = fs->root_dir_block;
+		fs->view_snapshot = FS_SNAPSHOT_LIVE;
+		ret = 0;
+		goto out;
+	}
+
+	if (snapshot < 0 || snapshot >= FS_SNAPSHOT_MAX_COUNT ||
+	    load_snapshot(fs, snapshot) < 0) {
+		fs_error("snapshot [%d] doesnt exist", snapshot);
+		goto out;
+	}
+
+	fs->view_dir      = fs->snapshot_dirs[snapshot];
+	fs->view_snapshot = snapshot;
+	ret = 0;
+out:
+	pthread_rwlock_unlock(&fs->dir_lock);
+	return ret;
+}
+
+
+/*
+Delete a snapshot:
+	1. The snapshot can be neither mounted nor have open files.
+	2. Release the chains of its files, freeing the blocks that were only
+	   kept alive by the snapshot.
+	3. Remove its system file.
+*/
+int fs_snapshot_delete_r(fs_t fs, int snapshot) {
+
+	PREEMPT_DISABLE_SCOPE();
+
+	pthread_rwlock_wrlock(&fs->dir_lock);
+	int ret = -1;
+
+	if (snapshot < 0 || snapshot >= FS_SNAPSHOT_MAX_COUNT ||
+	    load_snapshot(fs, snapshot) < 0) {
+		fs_error("snapshot [%d] doesnt exist", snapshot);
+		goto out;
+	}
+	if (is_snapshot_busy(fs, snapshot)) {
+		fs_error("snapshot [%d] is currently in use", snapshot);
+		goto out;
+	}
+
+	struct rootdirectory_t *frozen_dir = fs->snapshot_dirs[snapshot];
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (frozen_dir[i].filename[0] != EMPTY)
+			release_chain(fs, frozen_dir[i].start_data_block);
+	}
+
+	char snapshot_name[FS_FILENAME_LEN];
+	snprintf(snapshot_name, FS_FILENAME_LEN, SNAPSHOT_FILE, snapshot);
+	remove_entry(fs, locate_file(fs, snapshot_name));
+
+	free(frozen_dir);
+	fs->snapshot_dirs[snapshot] = NULL;
+	ret = 0;
+out:
+	pthread_rwlock_unlock(&fs->dir_lock);
+	return ret;
+}
+
+
+/*
+Default instance:
+	The public API without the _r suffix, on the default instance.
+*/
+int fs_mount(const char *diskname) { return fs_mount_r(&default_fs, diskname); }
+int fs_umount(void) { return fs_umount_r(&default_fs); }
+int fs_info(void) { return fs_info_r(&default_fs); }
+int fs_create(const char *filename) { return fs_create_r(&default_fs, filename); }
+int fs_delete(const char *filename) { return fs_delete_r(&default_fs, filename); }
+int fs_ls(void) { return fs_ls_r(&default_fs); }
+int fs_open(const char *filename) { return fs_open_r(&default_fs, filename); }
+int fs_open_flags(const char *filename, int flags) { return fs_open_flags_r(&default_fs, filename, flags); }
+int fs_close(int fd) { return fs_close_r(&default_fs, fd); }
+int fs_stat(int fd) { return fs_stat_r(&default_fs, fd); }
+int fs_lseek(int fd, size_t offset) { return fs_lseek_r(&default_fs, fd, offset); }
+int fs_write(int fd, void *buf, size_t count) { return fs_write_r(&default_fs, fd, buf, count); }
+int fs_read(int fd, void *buf, size_t count) { return fs_read_r(&default_fs, fd, buf, count); }
+int fs_import(int fd, int host_fd, size_t count) { return fs_import_r(&default_fs, fd, host_fd, count); }
+int fs_export(int fd, int host_fd, size_t count) { return fs_export_r(&default_fs, fd, host_fd, count); }
+int fs_clone(const char *src, const char *dst) { return fs_clone_r(&default_fs, src, dst); }
+int fs_snapshot_create(void) { return fs_snapshot_create_r(&default_fs); }
+int fs_snapshot_mount(int snapshot) { return fs_snapshot_mount_r(&default_fs, snapshot); }
+int fs_snapshot_delete(int snapshot) { return fs_snapshot_delete_r(&default_fs, snapshot); }
+
+
+/*
+Reserve the blocks of a write at a given offset:
+	1. Copy the shared blocks that the write modifies (copy-on-write).
+	2. Zero the end of the old tail block if the write leaves a hole.
+	3. Extend the chain with as many blocks as the write needs (or as many as
+	   the disk still has), starting from the cached tail block.
+	4. Return how many bytes of the write fit, and the block holding @offset
+	   in @first_fat_index.
+*/
+static size_t reserve_write(fs_t fs, int file_index, size_t offset, size_t count, int *first_fat_index) {
+
+	struct rootdirectory_t *the_dir = &fs->root_dir_block[file_index];	
+	struct chain_cache_t *cache = &fs->chain_cache[file_index];
+
+	// the modified blocks, and the tail if the chain grows, must belong to
+	// this file only
+	load_chain_cache(fs, file_index);
+	int needed_blocks = (offset + count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int last_block = needed_blocks - 1;
+	if (last_block >= cache->num_blocks)
+		last_block = cache->num_blocks - 1;
+	if (last_block >= 0 && unshare_chain(fs, file_index, last_block, offset, count) < 0)
+		return 0;
+
+	// remember where the chain ended before extending it
+	int old_num_blocks = cache->num_blocks;
+	int old_tail_block = cache->tail_block;
+	uint32_t old_file_size = the_dir->file_size;
+
+	// a write that starts past the blocks the disk can still provide would
+	// only fill the disk with holes
+	if (offset / BLOCK_SIZE >= cache->num_blocks &&
+	    offset / BLOCK_SIZE >= cache->num_blocks + get_num_FAT_free_blocks(fs))
+		return 0;
+
+	// the end of the old tail block, up to the offset, reads as zeros now
+	if (offset > old_file_size && old_file_size % BLOCK_SIZE != 0 &&
+	    !is_hole_block(fs, old_tail_block)) {
+		size_t gap_end = old_file_size - old_file_size % BLOCK_SIZE + BLOCK_SIZE;
+		if (offset < gap_end)
+			gap_end = offset;
+		char *cached = cache_get_block(fs, old_tail_block, true);
+		if (cached == NULL)
+			return 0;
+		memset(cached + old_file_size % BLOCK_SIZE, 0, gap_end - old_file_size);
+		cache_mark_dirty(fs, old_tail_block);
+		cache_release_block(fs, old_tail_block);
+	}
+
+	// extend the chain to hold the whole write, if possible: the new blocks
+	// are holes until written
+	if (needed_blocks > cache->num_blocks)
+		extend_chain(fs, file_index, needed_blocks - cache->num_blocks);
+
+	// for the case where there are no more availabe data blocks on disk
+	size_t capacity = (size_t)cache->num_blocks * BLOCK_SIZE;
+	if (offset >= capacity)
+		return 0;
+	if (offset + count > capacity)
+		count = capacity - offset;
+
+	// get to starting block: appends start from the old tail instead
+	// of walking the chain from the first data block
+	int cur_block = offset / BLOCK_SIZE;
+	if (old_num_blocks > 0 && cur_block >= old_num_blocks - 1)
+		*first_fat_index = go_to_cur_FAT_block(fs, old_tail_block,
+						cur_block - (old_num_blocks - 1));
+	else
+		*first_fat_index = go_to_cur_FAT_block(fs, the_dir->start_data_block,
+						cur_block);
+
+	return count;
+}
+
+
+// helper: write
+// Write at @offset if @is_positioned, and at the file offset of @fd otherwise
+static int write_fd(fs_t fs, int fd, void *buf, size_t count, size_t offset, bool is_positioned)
+{
+	// Error Checking 
+	if (count <= 0) {
+        fs_error("request nbytes amount is trivial" );
+        return -1;
+	} else if (fd <= -1 || fd >= FS_OPEN_MAX_COUNT) {
+        fs_error("invalid file descriptor [%d] \n", fd);
+        return -1;
+	} else if (fs->fd_table[fd].is_used == false) {
+        fs_error("file descriptor is not open");
+        return -1;
+	} else if (fs->fd_table[fd].dir != fs->root_dir_block) {
+        fs_error("file descriptor belongs to a read-only snapshot");
+        return -1;
+	}
+
+	// find relative information about file 
+	int file_index = fs->fd_table[fd].file_index;				
+	lock_fd_file(fs, fd, true);
+
+	if (!is_positioned)
+		offset = fs->fd_table[fd].offset;
+	if (fs->fd_table[fd].flags & FS_O_APPEND)
+		offset = fs->root_dir_block[file_index].file_size;
+
+	int total_byte_written = file_write_at(fs, file_index, offset, buf, count, fs->fd_table[fd].flags);
+	unlock_fd_file(fs, fd);
+
+	if (!is_positioned && total_byte_written > 0)
+		fs->fd_table[fd].offset = offset + total_byte_written;
+	return total_byte_written;
+}
+
+
+// helper: read
+// Read at @offset if @is_positioned, and at the file offset of @fd otherwise
+static int read_fd(fs_t fs, int fd, void *buf, size_t count, size_t offset, bool is_positioned)
+{
+	
+	// error check 
+    if(fd < 0 || fd >= FS_OPEN_MAX_COUNT ||
+	   fs->fd_table[fd].is_used == false) {
+		fs_error("invalid file descriptor [%d]", fd);
+        return -1;
+    } else if (count <= 0) {
+		fs_error("request nbyte amount is trivial");
+		return -1;
+	} 
+
+	// gather nessessary information 
+	struct rootdirectory_t *the_dir = &fs->fd_table[fd].dir[fs->fd_table[fd].file_index];
+	if (!is_positioned)
+		offset = fs->fd_table[fd].offset;
+
+	lock_fd_file(fs, fd, false);
+	int total_bytes_read = file_read_at(fs, the_dir, offset, buf, count);
+	unlock_fd_file(fs, fd);
+
+	if (!is_positioned && total_bytes_read > 0)
+		fs->fd_table[fd].offset += total_bytes_read;
+	return total_bytes_read;
+}
+
+
+/*
+Write to a file at a given offset:
+	1. Reserve the blocks of the write.
+	2. Write block per block. Runs of whole blocks which are contiguous on
+	   disk are written directly from @buf with a single I/O, partially
+	   written blocks are merged into their cached copy and written back
+	   later.
+	3. With FS_O_DEDUP in @flags, record the hash of every whole block.
+*/
+static int file_write_at(fs_t fs, int file_index, size_t offset, const void *buf, size_t count, int flags) {
+
+	struct rootdirectory_t *the_dir = &fs->root_dir_block[file_index];	
+
+	if (the_dir->flags & FILE_COMPRESSED)
+		return compressed_write_at(fs, file_index, offset, buf, count);
+
+	uint32_t old_file_size = the_dir->file_size;
+	int curr_fat_index;
+	count = reserve_write(fs, file_index, offset, count, &curr_fat_index);
+	if (count == 0)
+		return 0;
+	int cur_block = offset / BLOCK_SIZE;
+
+	// set up information for iterating through blocks
+	const char *write_buf = (const char*)buf;
+	
+	int amount_to_write = count;
+	int left_shift;
+	int total_byte_written = 0;
+	int location = offset % BLOCK_SIZE;
+	bool has_failed = false;
+
+	// main iteration loop for writing block per block
+	while (amount_to_write > 0) {
+		if (location + amount_to_write > BLOCK_SIZE) {
+			left_shift = BLOCK_SIZE - location;
+		} else {
+			left_shift = amount_to_write;
+		}
+
+		int run_length = 1;
+		if (left_shift == BLOCK_SIZE) {
+			// whole blocks: write the physically contiguous run straight
+			// from the caller's buffer, with a single I/O
+			run_length = get_run_length(fs, curr_fat_index, amount_to_write / BLOCK_SIZE);
+			left_shift = run_length * BLOCK_SIZE;
+			cache_drop_run(fs, curr_fat_index, run_length);
+			if (block_write_run_r(fs->disk, curr_fat_index + fs->superblock->data_start_index, run_length, (void*)write_buf) < 0) {
+				has_failed = true;
+				break;
+			}
+			if (flags & FS_O_DEDUP) {
+				for (int i = 0; i < run_length; i++)
+					dedup_index_insert(fs, curr_fat_index + i, hash_block(write_buf + i * BLOCK_SIZE));
+			}
+		} else {
+			// partially written block: read-modify-write in the cache, the
+			// existing bytes only matter if the block holds file data
+			bool fill = (size_t)cur_block * BLOCK_SIZE < old_file_size;
+			char *cached = cache_get_block(fs, curr_fat_index, fill);
+			if (cached == NULL) {
+				has_failed = true;
+				break;
+			}
+
+			memcpy(cached + location, write_buf, left_shift);
+			cache_mark_dirty(fs, curr_fat_index);
+			cache_release_block(fs, curr_fat_index);
+		}
+		
+		// position array to left block 
+		total_byte_written += left_shift;
+		write_buf += left_shift;
+
+		location= 0;
+		amount_to_write -= left_shift;
+
+		// next: the block following the run
+		curr_fat_index = fs->FAT_blocks[curr_fat_index + run_length - 1].words;
+		cur_block += run_length;
+	}
+
+	// update filesize accordingly to how much was written 
+	if(offset + total_byte_written > the_dir->file_size){
+		the_dir->file_size = offset + total_byte_written;
+	}
+
+	// the bytes before a disk failure are written, if any
+	if (has_failed && total_byte_written == 0)
+		return -1;
+	return total_byte_written;
+}
+
+
+/*
+Read a File at a given offset:
+	1. Never read past the end of the file.
+	2. Read block per block, directly into @buf for whole blocks and
+	   through the buffer cache for partial ones. Whole blocks which are
+	   contiguous on disk are read as one run, with a single I/O.
+	3. Holes read as zeros, without I/O.
+*/
+static int file_read_at(fs_t fs, struct rootdirectory_t *the_dir, size_t offset, void *buf, size_t count) {
+
+	if (the_dir->flags & FILE_COMPRESSED)
+		return compressed_read_at(fs, the_dir, offset, buf, count);
+
+	// check if offset of file exceeds the file_size
+	int amount_to_read = 0;
+	if (offset >= the_dir->file_size)
+		return 0;
+	if (offset + count > the_dir->file_size) 
+		amount_to_read = the_dir->file_size - offset;
+	else amount_to_read = count;
+
+	char *read_buf = (char *)buf;
+	int FAT_iter = the_dir->start_data_block;
+	
+	// block level
+	int cur_block = offset / BLOCK_SIZE; 
+
+	// byte level
+	int location= offset % BLOCK_SIZE;
+		
+	// go to correct current block in fat entry
+	FAT_iter = go_to_cur_FAT_block(fs, FAT_iter, cur_block);
+
+	// read through the number of blocks it contains
+	unsigned int writebacks[CACHE_NUM_SLOTS];
+	int left_shift = 0;
+	int total_bytes_read = 0;
+	bool has_failed = false;
+	while (amount_to_read > 0) {
+		if (location+ amount_to_read > BLOCK_SIZE) {
 			left_shift = BLOCK_SIZE - location;
 		} else {
 			left_shift = amount_to_read;
 		}
 
-		// read file contents 
-		block_read(FAT_iter + superblock->data_start_index, (void*)bounce_buff);
-		memcpy(read_buf, bounce_buff + location, left_shift);
+		// read file contents: physically contiguous runs of whole blocks
+		// go straight to the caller's buffer with a single I/O, only
+		// partial head and tail blocks go through the cache
+		int run_length = 1;
+		if (left_shift == BLOCK_SIZE) {
+			run_length = get_run_length(fs, FAT_iter, amount_to_read / BLOCK_SIZE);
+			left_shift = run_length * BLOCK_SIZE;
+			if (is_hole_block(fs, FAT_iter)) {
+				memset(read_buf, 0, left_shift);
+			} else {
+				cache_save_writebacks(fs, writebacks);
+				if (block_read_run_r(fs->disk, FAT_iter + fs->superblock->data_start_index, run_length, (void*)read_buf) < 0) {
+					has_failed = true;
+					break;
+				}
+				cache_patch_run(fs, FAT_iter, run_length, read_buf, writebacks);
+			}
+		} else {
+			char *cached = cache_get_block(fs, FAT_iter, true);
+			if (cached == NULL) {
+				has_failed = true;
+				break;
+			}
+			memcpy(read_buf, cached + location, left_shift);
+			cache_release_block(fs, FAT_iter);
+		}
 
 		// position array to left block 
 		total_bytes_read += left_shift;
@@ -597,14 +1553,209 @@ int fs_read(int fd, void *buf, size_t count) {
 		// next block starts at the top
 		location= 0;
 
-		// next 
-		FAT_iter = FAT_blocks[FAT_iter].words;
+		// next: the block following the run
+		FAT_iter = fs->FAT_blocks[FAT_iter + run_length - 1].words;
 
 		// reduce the amount to read by the amount that was read 
 		amount_to_read -= left_shift;
 	}
 
-	fd_table[fd].offset += total_bytes_read;
+	// the bytes before a disk failure are read, if any
+	if (has_failed && total_bytes_read == 0)
+		return -1;
+	return total_bytes_read;
+}
+
+
+/*
+Write to a compressed file at a given offset:
+	1. Give the file its chunk map block on the first write.
+	2. Copy the shared blocks, up to the last modified chunk.
+	3. For every modified chunk: merge the new bytes into the uncompressed
+	   chunk, compress it again and write it to fresh blocks, which then
+	   replace its part of the chain. A chunk that cannot be written keeps
+	   its old blocks, so the chunk map stays in step with the chain.
+	4. Save the updated chunk map.
+*/
+static int compressed_write_at(fs_t fs, int file_index, size_t offset, const void *buf, size_t count) {
+
+	struct rootdirectory_t *the_dir = &fs->root_dir_block[file_index];
+
+	// files are limited by the size of the chunk map
+	size_t max_size = CHUNK_MAX_COUNT * CHUNK_SIZE;
+	if (offset >= max_size)
+		return 0;
+	if (offset + count > max_size)
+		count = max_size - offset;
+
+	if (the_dir->start_data_block == EOC) {
+		if (extend_chain(fs, file_index, 1) == 0)
+			return 0;
+		if (cache_get_block(fs, the_dir->start_data_block, false) == NULL)
+			return 0;
+		cache_mark_dirty(fs, the_dir->start_data_block);
+		cache_release_block(fs, the_dir->start_data_block);
+	}
+
+	uint16_t *chunk_map = malloc(BLOCK_SIZE);
+	char *chunk_buf = malloc(CHUNK_SIZE);
+	char *comp_buf = malloc(CHUNK_SIZE);
+	int total_byte_written = 0;
+	bool has_failed = false;
+	if (chunk_map == NULL || chunk_buf == NULL || comp_buf == NULL)
+		goto out;
+
+	char *cached = cache_get_block(fs, the_dir->start_data_block, true);
+	if (cached == NULL)
+		goto out;
+	memcpy(chunk_map, cached, BLOCK_SIZE);
+	cache_release_block(fs, the_dir->start_data_block);
+
+	// the chain must belong to this file up to the last modified chunk
+	int first_chunk = offset / CHUNK_SIZE;
+	int last_chunk = (offset + count - 1) / CHUNK_SIZE;
+	int last_block = 0;
+	for (int c = 0; c <= last_chunk; c++)
+		last_block += get_chunk_num_blocks(chunk_map[c]);
+	if (unshare_chain(fs, file_index, last_block, 0, 0) < 0)
+		goto out;
+
+	// block preceding the first modified chunk
+	int prev_fat_index = the_dir->start_data_block;
+	for (int c = 0; c < first_chunk; c++)
+		prev_fat_index = go_to_cur_FAT_block(fs, prev_fat_index, get_chunk_num_blocks(chunk_map[c]));
+
+	const char *write_buf = (const char*)buf;
+	for (int c = first_chunk; c <= last_chunk; c++) {
+		size_t chunk_start = (size_t)c * CHUNK_SIZE;
+		size_t lo = offset > chunk_start ? offset : chunk_start;
+		size_t hi = offset + count < chunk_start + CHUNK_SIZE ? offset + count : chunk_start + CHUNK_SIZE;
+		int old_amount = get_chunk_num_blocks(chunk_map[c]);
+		int old_first = old_amount ? fs->FAT_blocks[prev_fat_index].words : EOC;
+
+		// uncompressed chunk, unless the write replaces all of it
+		if (hi - lo < CHUNK_SIZE) {
+			if (chunk_map[c] == 0) {
+				memset(chunk_buf, 0, CHUNK_SIZE);
+			} else {
+				char *data = chunk_cache_get(fs, old_first, chunk_map[c]);
+				if (data == NULL)
+					break;
+				memcpy(chunk_buf, data, CHUNK_SIZE);
+				chunk_cache_release(fs);
+			}
+		}
+		memcpy(chunk_buf + (lo - chunk_start), write_buf + (lo - offset), hi - lo);
+
+		// keep the chunk as is if compressing does not save a block
+		uint16_t chunk_len = lz_compress(chunk_buf, CHUNK_SIZE, comp_buf, CHUNK_SIZE - BLOCK_SIZE);
+		char *chunk_data = comp_buf;
+		if (chunk_len == 0) {
+			chunk_len = CHUNK_SIZE;
+			chunk_data = chunk_buf;
+		}
+		int new_amount = get_chunk_num_blocks(chunk_len);
+		memset(chunk_data + chunk_len, 0, new_amount * BLOCK_SIZE - chunk_len);
+
+		int new_blocks[CHUNK_BLOCKS];
+		if (alloc_chunk_blocks(fs, new_blocks, new_amount) < 0)
+			break;
+		int i;
+		for (i = 0; i < new_amount; i++) {
+			cache_drop_run(fs, new_blocks[i], 1);
+			if (block_write_r(fs->disk, new_blocks[i] + fs->superblock->data_start_index, (void*)(chunk_data + i * BLOCK_SIZE)) < 0)
+				break;
+		}
+		if (i < new_amount) {
+			free_chunk_blocks(fs, new_blocks, new_amount);
+			has_failed = true;
+			break;
+		}
+
+		// the old blocks get freed, and their decompressed copy dropped
+		replace_chain_segment(fs, file_index, prev_fat_index, old_amount, new_blocks, new_amount);
+		chunk_cache_put(fs, new_blocks[0], chunk_buf);
+		prev_fat_index = new_blocks[new_amount - 1];
+
+		chunk_map[c] = chunk_len;
+		total_byte_written += hi - lo;
+	}
+
+	// save the chunk map, in the (now private) first block
+	cached = cache_get_block(fs, the_dir->start_data_block, true);
+	if (cached != NULL) {
+		memcpy(cached, chunk_map, BLOCK_SIZE);
+		cache_mark_dirty(fs, the_dir->start_data_block);
+		cache_release_block(fs, the_dir->start_data_block);
+	}
+
+	if (offset + total_byte_written > the_dir->file_size)
+		the_dir->file_size = offset + total_byte_written;
+
+out:
+	free(chunk_map);
+	free(chunk_buf);
+	free(comp_buf);
+	if (has_failed && total_byte_written == 0)
+		return -1;
+	return total_byte_written;
+}
+
+
+/*
+Read a compressed File at a given offset:
+	1. Never read past the end of the file.
+	2. Skip the compressed chunks before the offset, using the chunk map.
+	3. Copy from the decompressed chunks, through the chunk cache.
+*/
+static int compressed_read_at(fs_t fs, struct rootdirectory_t *the_dir, size_t offset, void *buf, size_t count) {
+
+	if (offset >= the_dir->file_size)
+		return 0;
+	if (offset + count > the_dir->file_size)
+		count = the_dir->file_size - offset;
+
+	uint16_t *chunk_map = malloc(BLOCK_SIZE);
+	if (chunk_map == NULL)
+		return 0;
+	char *cached = cache_get_block(fs, the_dir->start_data_block, true);
+	if (cached == NULL) {
+		free(chunk_map);
+		return 0;
+	}
+	memcpy(chunk_map, cached, BLOCK_SIZE);
+	cache_release_block(fs, the_dir->start_data_block);
+
+	int first_chunk = offset / CHUNK_SIZE;
+	int last_chunk = (offset + count - 1) / CHUNK_SIZE;
+
+	// first block of the first chunk to read
+	int cur_fat_index = fs->FAT_blocks[the_dir->start_data_block].words;
+	for (int c = 0; c < first_chunk; c++)
+		cur_fat_index = go_to_cur_FAT_block(fs, cur_fat_index, get_chunk_num_blocks(chunk_map[c]));
+
+	char *read_buf = (char*)buf;
+	int total_bytes_read = 0;
+	for (int c = first_chunk; c <= last_chunk; c++) {
+		size_t chunk_start = (size_t)c * CHUNK_SIZE;
+		size_t lo = offset > chunk_start ? offset : chunk_start;
+		size_t hi = offset + count < chunk_start + CHUNK_SIZE ? offset + count : chunk_start + CHUNK_SIZE;
+
+		if (chunk_map[c] == 0) {
+			memset(read_buf + (lo - offset), 0, hi - lo);
+		} else {
+			char *data = chunk_cache_get(fs, cur_fat_index, chunk_map[c]);
+			if (data == NULL)
+				break;
+			memcpy(read_buf + (lo - offset), data + (lo - chunk_start), hi - lo);
+			chunk_cache_release(fs);
+		}
+
+		total_bytes_read += hi - lo;
+		cur_fat_index = go_to_cur_FAT_block(fs, cur_fat_index, get_chunk_num_blocks(chunk_map[c]));
+	}
+
+	free(chunk_map);
 	return total_bytes_read;
 }
 
@@ -614,20 +1765,26 @@ Locate Existing File
 	1. Return the position of first filename that matches the search,
 	   and is in use (contains data).
 */
-static int locate_file(const char* file_name) {
+static int locate_file(fs_t fs, const char* file_name) {
+	return locate_file_in(fs->root_dir_block, file_name);
+}
+
+
+// Same as locate_file, in the root directory of a snapshot
+static int locate_file_in(struct rootdirectory_t *dir, const char* file_name) {
 	int i;
     for(i = 0; i < FS_FILE_MAX_COUNT; i++) 
-        if(strncmp(root_dir_block[i].filename, file_name, FS_FILENAME_LEN) == 0 &&  
-			      root_dir_block[i].filename != EMPTY) 
+        if(strncmp(dir[i].filename, file_name, FS_FILENAME_LEN) == 0 &&  
+			      dir[i].filename[0] != EMPTY) 
             return i;  
     return -1;      
 }
 
 
-static int locate_avail_fd() {
+static int locate_avail_fd(fs_t fs) {
 	int i;
 	for(i = 0; i < FS_OPEN_MAX_COUNT; i++) 
-        if(fd_table[i].is_used == false) 
+        if(fs->fd_table[i].is_used == false) 
 			return i; 
     return -1;
 }
@@ -639,28 +1796,23 @@ Perform Error Checking
 	2. Check if file already exists 
     3. Check if root directory has max number of files 
 */
-static bool error_free(const char *filename){
+static bool error_free(fs_t fs, const char *filename){
 
-	// get size 
+	// get size (the NULL character must fit too)
 	int size = strlen(filename);
-	if(size > FS_FILENAME_LEN){
+	if(size == 0 || size >= FS_FILENAME_LEN){
 		fs_error("File name is longer than FS_FILE_MAX_COUNT\n");
 		return false;
 	}
 
 	// check if file already exists 
-	int same_char = 0;
 	int files_in_rootdir = 0;
 	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
-		for(int j = 0; j < size; j ++){
-			if(root_dir_block[i].filename[j] == filename[j])
-				same_char++;
-		}
-		if(root_dir_block[i].filename[0] != EMPTY)
+		if(fs->root_dir_block[i].filename[0] != EMPTY)
 			files_in_rootdir++;
 	}
 	// File already exists
-	if(same_char == size){
+	if(locate_file(fs, filename) != -1){
 		fs_error("file @[%s] already exists\n", filename);
 		return false;
 	}
@@ -682,19 +1834,19 @@ Is the file open?
 		a) The file exists in the root directory
 		b) Its cooresponding file descriptor is active
 */
-static bool is_open(const char* filename)
+static bool is_open(fs_t fs, const char* filename)
 {
-	int file_index = locate_file(filename);
+	int file_index = locate_file(fs, filename);
 
 	if (file_index == -1) {
 		fs_error("file @[%s] doesnt exist\n", filename);
         return true;
 	}
 
-	struct rootdirectory_t* the_dir = &root_dir_block[file_index]; 
+	struct rootdirectory_t* the_dir = &fs->root_dir_block[file_index]; 
 	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		if(strncmp(the_dir->filename, fd_table[i].file_name, FS_FILENAME_LEN) == 0 
-		   && fd_table[i].is_used) {
+		if(strncmp(the_dir->filename, fs->fd_table[i].file_name, FS_FILENAME_LEN) == 0 
+		   && fs->fd_table[i].is_used && fs->fd_table[i].dir == fs->root_dir_block) {
 			fs_error("cannot remove file @[%s] as it is currently open\n", filename);
 			return true;
 		}
@@ -704,22 +1856,23 @@ static bool is_open(const char* filename)
 }
 
 // helper: info
-static int get_num_FAT_free_blocks()
+// The counters are kept up to date by reserve_extent(), free_data_block()
+// and return_pool(), so that no lock is needed
+static int get_num_FAT_free_blocks(fs_t fs)
 {
-	int count = 0;
-	for (int i = 1; i < superblock->num_data_blocks; i++) {
-		if (FAT_blocks[i].words == EMPTY) count++;
-	}
+	int count = __atomic_load_n(&fs->num_free_blocks, __ATOMIC_RELAXED);
+	// blocks reserved by the pools are still free
+	count += __atomic_load_n(&fs->num_pooled_blocks, __ATOMIC_RELAXED);
 	return count;
 }
 
 
 // helper: info
-static int count_num_open_dir(){
+static int count_num_open_dir(fs_t fs){
 
 	int i, count = 0;
 	for(i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if(root_dir_block[i].filename[0] == EMPTY)
+		if(fs->root_dir_block[i].filename[0] == EMPTY)
 			count++;
 	}
 	return count;
@@ -727,15 +1880,1424 @@ static int count_num_open_dir(){
 
 
 // helper: read and write 
-static int go_to_cur_FAT_block(int cur_fat_index, int iter_amount)
+static int go_to_cur_FAT_block(fs_t fs, int cur_fat_index, int iter_amount)
 {
 	for (int i = 0; i < iter_amount; i++) {
 		if (cur_fat_index == EOC) {
 			fs_error("attempted to exceed end of file chain");
 			return -1;
 		}
-		cur_fat_index = FAT_blocks[cur_fat_index].words;
+		cur_fat_index = fs->FAT_blocks[cur_fat_index].words;
 	}
 	return cur_fat_index;
 }
 
+
+// helper: write
+// Take a block from the pool of the calling thread, refilling it if needed.
+// Called with the allocator lock held
+static int alloc_data_block(fs_t fs)
+{
+	struct alloc_pool_t *pool = get_pool(fs);
+	if (pool == NULL) {
+		int block;
+		if (reserve_extent(fs, 1, &block) == 0) {
+			reclaim_pools(fs);
+			if (reserve_extent(fs, 1, &block) == 0)
+				return -1;
+		}
+		return block;
+	}
+
+	int block = take_pool_block(fs, pool);
+	if (block != -1)
+		return block;
+
+	// on pressure, the blocks reserved by the other threads come back first
+	if (refill_pool(fs, pool) == 0) {
+		reclaim_pools(fs);
+		if (refill_pool(fs, pool) == 0)
+			return -1;
+	}
+	return take_pool_block(fs, pool);
+}
+
+
+// helper: delete
+// Called with the allocator lock held
+static void free_data_block(fs_t fs, int block)
+{
+	fs->FAT_blocks[block].words = EMPTY;
+	__atomic_fetch_add(&fs->num_free_blocks, 1, __ATOMIC_RELAXED);
+	cache_drop_run(fs, block, 1);
+	chunk_cache_drop(fs, block);
+	if (block < fs->first_free_block)
+		fs->first_free_block = block;
+}
+
+
+// helper: pools
+// Reserve the first free block, and up to max_blocks - 1 free blocks right
+// after it. Called with the allocator lock held
+static int reserve_extent(fs_t fs, int max_blocks, int *start_block)
+{
+	int num_blocks = 0;
+	int i = fs->first_free_block;
+
+	// first fit, starting from the lowest block that may be free
+	while (i < fs->superblock->num_data_blocks &&
+	       __atomic_load_n(&fs->FAT_blocks[i].words, __ATOMIC_RELAXED) != EMPTY)
+		i++;
+	*start_block = i;
+	while (i < fs->superblock->num_data_blocks && num_blocks < max_blocks &&
+	       fs->FAT_blocks[i].words == EMPTY) {
+		fs->FAT_blocks[i].words = EOC;
+		num_blocks++;
+		i++;
+	}
+	fs->first_free_block = i;
+	__atomic_fetch_sub(&fs->num_free_blocks, num_blocks, __ATOMIC_RELAXED);
+	return num_blocks;
+}
+
+
+// helper: pools
+// Return the pool of the calling thread, created on first use. NULL if it
+// cannot be allocated
+static struct alloc_pool_t *get_pool(fs_t fs)
+{
+	struct alloc_pool_t *pool = pthread_getspecific(fs->pool_key);
+	if (pool)
+		return pool;
+
+	pool = calloc(1, sizeof(struct alloc_pool_t));
+	if (pool == NULL)
+		return NULL;
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->fs = fs;
+	if (pthread_setspecific(fs->pool_key, pool)) {
+		pthread_mutex_destroy(&pool->lock);
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&fs->pool_list_lock);
+	pool->next = fs->pools;
+	fs->pools = pool;
+	pthread_mutex_unlock(&fs->pool_list_lock);
+	return pool;
+}
+
+
+// helper: pools
+// Take the next reserved block of a pool, -1 if it is empty. Only the lock
+// of the pool is taken, which no other thread contends for until reclaimed
+static int take_pool_block(fs_t fs, struct alloc_pool_t *pool)
+{
+	int block = -1;
+	pthread_mutex_lock(&pool->lock);
+	if (pool->next_block < pool->end_block) {
+		block = pool->next_block++;
+		__atomic_fetch_sub(&fs->num_pooled_blocks, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return block;
+}
+
+
+// helper: pools
+// Reserve a new extent for an empty pool, return its length (0 if the disk
+// is full). Called with the allocator lock held
+static int refill_pool(fs_t fs, struct alloc_pool_t *pool)
+{
+	int start_block;
+	int num_blocks = reserve_extent(fs, POOL_EXTENT_BLOCKS, &start_block);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->next_block = start_block;
+	pool->end_block  = start_block + num_blocks;
+	__atomic_fetch_add(&fs->num_pooled_blocks, num_blocks, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&pool->lock);
+	return num_blocks;
+}
+
+
+// helper: pools
+// Give the remaining blocks of a pool back to the free blocks. Called with
+// the allocator lock held
+static void return_pool(fs_t fs, struct alloc_pool_t *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	int num_blocks = pool->end_block - pool->next_block;
+	for (int i = pool->next_block; i < pool->end_block; i++)
+		fs->FAT_blocks[i].words = EMPTY;
+	if (num_blocks > 0 && pool->next_block < fs->first_free_block)
+		fs->first_free_block = pool->next_block;
+	__atomic_fetch_add(&fs->num_free_blocks, num_blocks, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&fs->num_pooled_blocks, num_blocks, __ATOMIC_RELAXED);
+	pool->next_block = pool->end_block = 0;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+
+// helper: pools
+// Called with the allocator lock held
+static void reclaim_pools(fs_t fs)
+{
+	pthread_mutex_lock(&fs->pool_list_lock);
+	for (struct alloc_pool_t *pool = fs->pools; pool; pool = pool->next)
+		return_pool(fs, pool);
+	pthread_mutex_unlock(&fs->pool_list_lock);
+}
+
+
+// helper: pools
+// Allocate a block for the calling thread, without the allocator lock while
+// its pool has some left
+static int pool_alloc_block(fs_t fs)
+{
+	struct alloc_pool_t *pool = get_pool(fs);
+	if (pool) {
+		int block = take_pool_block(fs, pool);
+		if (block != -1)
+			return block;
+	}
+
+	pthread_mutex_lock(&fs->alloc_lock);
+	int block = alloc_data_block(fs);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	return block;
+}
+
+
+// helper: close
+static void release_pool(fs_t fs)
+{
+	struct alloc_pool_t *pool = pthread_getspecific(fs->pool_key);
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&fs->alloc_lock);
+	return_pool(fs, pool);
+	pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+
+// helper: pools
+// Run when a thread with a pool exits while the file system is mounted
+static void pool_destructor(void *arg)
+{
+	struct alloc_pool_t *pool = arg;
+	fs_t fs = pool->fs;
+
+	pthread_mutex_lock(&fs->alloc_lock);
+	return_pool(fs, pool);
+	pthread_mutex_lock(&fs->pool_list_lock);
+	struct alloc_pool_t **link = &fs->pools;
+	while (*link != pool)
+		link = &(*link)->next;
+	*link = pool->next;
+	pthread_mutex_unlock(&fs->pool_list_lock);
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+
+// helper: mount
+static void init_pools(fs_t fs)
+{
+	pthread_key_create(&fs->pool_key, pool_destructor);
+	fs->pools = NULL;
+	fs->num_pooled_blocks = 0;
+}
+
+
+// helper: umount
+// Give all the reserved blocks back, and forget the pools of all threads
+static void destroy_pools(fs_t fs)
+{
+	pthread_mutex_lock(&fs->alloc_lock);
+	reclaim_pools(fs);
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	while (fs->pools) {
+		struct alloc_pool_t *pool = fs->pools;
+		fs->pools = pool->next;
+		pthread_mutex_destroy(&pool->lock);
+		free(pool);
+	}
+	pthread_key_delete(fs->pool_key);
+}
+
+
+// helper: walk the chain of a file once, and remember its tail and length
+static void load_chain_cache(fs_t fs, int file_index)
+{
+	struct chain_cache_t *cache = &fs->chain_cache[file_index];
+	if (cache->is_valid)
+		return;
+
+	int cur_fat_index = fs->root_dir_block[file_index].start_data_block;
+	cache->tail_block = EOC;
+	cache->num_blocks = 0;
+	cache->may_share  = false;
+	while (cur_fat_index != EOC) {
+		cache->tail_block = cur_fat_index;
+		cache->num_blocks++;
+		if (fs->block_refs[cur_fat_index] != 0)
+			cache->may_share = true;
+		cur_fat_index = fs->FAT_blocks[cur_fat_index].words;
+	}
+	cache->is_valid = true;
+}
+
+
+// helper: link up to amount new blocks after the tail of a file's chain,
+// holes until written
+static int extend_chain(fs_t fs, int file_index, int amount)
+{
+	struct rootdirectory_t *the_dir = &fs->root_dir_block[file_index];
+	struct chain_cache_t *cache = &fs->chain_cache[file_index];
+	int added;
+
+	load_chain_cache(fs, file_index);
+	for (added = 0; added < amount; added++) {
+		int new_block = pool_alloc_block(fs);
+		if (new_block == -1)
+			break;
+
+		set_hole_block(fs, new_block, true);
+		if (cache->num_blocks == 0)
+			the_dir->start_data_block = new_block;
+		else
+			__atomic_store_n(&fs->FAT_blocks[cache->tail_block].words, new_block, __ATOMIC_RELAXED);
+		cache->tail_block = new_block;
+		cache->num_blocks++;
+	}
+	return added;
+}
+
+
+// helper: read and write
+// Count how many blocks of the chain, starting at cur_fat_index, are also
+// contiguous on disk (at most max_blocks), and all holes or all data
+static int get_run_length(fs_t fs, int cur_fat_index, int max_blocks)
+{
+	int run_length = 1;
+	bool is_hole = is_hole_block(fs, cur_fat_index);
+	while (run_length < max_blocks &&
+	       fs->FAT_blocks[cur_fat_index].words == cur_fat_index + 1 &&
+	       is_hole_block(fs, cur_fat_index + 1) == is_hole) {
+		cur_fat_index++;
+		run_length++;
+	}
+	return run_length;
+}
+
+
+// helper: cache
+// Return the cached copy of a data block, loading it from disk if fill is
+// set and the block is not a hole, or zeroing it otherwise. The slot stays
+// locked until cache_release_block(). NULL if the block cannot be read.
+static char *cache_get_block(fs_t fs, int block, bool fill)
+{
+	struct cache_slot_t *slot = &fs->block_cache[block % CACHE_NUM_SLOTS];
+	pthread_mutex_lock(&slot->lock);
+
+	if (!slot->is_valid || slot->block != block) {
+		// evict the previous occupant of the slot
+		if (slot->is_valid && slot->is_dirty) {
+			if (block_write_r(fs->disk, slot->block + fs->superblock->data_start_index, slot->data) < 0)
+				goto fail;
+			__atomic_fetch_add(&slot->writebacks, 1, __ATOMIC_RELEASE);
+		}
+		slot->is_valid = false;
+		slot->is_dirty = false;
+		slot->block    = block;
+
+		if (fill && !is_hole_block(fs, block)) {
+			if (block_read_r(fs->disk, block + fs->superblock->data_start_index, slot->data) < 0)
+				goto fail;
+		} else {
+			memset(slot->data, 0, BLOCK_SIZE);
+		}
+		slot->is_valid = true;
+	} else if (!fill) {
+		memset(slot->data, 0, BLOCK_SIZE);
+	}
+
+	return slot->data;
+
+fail:
+	pthread_mutex_unlock(&slot->lock);
+	return NULL;
+}
+
+
+// helper: cache
+static void cache_release_block(fs_t fs, int block)
+{
+	pthread_mutex_unlock(&fs->block_cache[block % CACHE_NUM_SLOTS].lock);
+}
+
+
+// helper: cache
+// The block, still locked, is modified: its hash is stale, and it is no hole
+// anymore
+static void cache_mark_dirty(fs_t fs, int block)
+{
+	fs->block_cache[block % CACHE_NUM_SLOTS].is_dirty = true;
+	dedup_index_remove(fs, block);
+	set_hole_block(fs, block, false);
+}
+
+
+// helper: cache
+// Forget the cached copies (and hashes, and holes) of blocks which are
+// overwritten or freed
+static void cache_drop_run(fs_t fs, int block, int amount)
+{
+	for (int i = block; i < block + amount; i++) {
+		struct cache_slot_t *slot = &fs->block_cache[i % CACHE_NUM_SLOTS];
+		pthread_mutex_lock(&slot->lock);
+		if (slot->is_valid && slot->block == i)
+			slot->is_valid = false;
+		pthread_mutex_unlock(&slot->lock);
+		dedup_index_remove(fs, i);
+		set_hole_block(fs, i, false);
+	}
+}
+
+
+// helper: cache
+// Remember how many blocks every slot wrote back, before reading blocks
+// directly from disk
+static void cache_save_writebacks(fs_t fs, unsigned int *writebacks)
+{
+	for (int i = 0; i < CACHE_NUM_SLOTS; i++)
+		writebacks[i] = __atomic_load_n(&fs->block_cache[i].writebacks, __ATOMIC_ACQUIRE);
+}
+
+
+// helper: cache
+// Blocks read directly from disk may be stale if a newer copy waits in the
+// cache to be written back, or was written back by another thread while
+// they were read: those are read again
+static void cache_patch_run(fs_t fs, int block, int amount, char *buf, unsigned int *writebacks)
+{
+	for (int i = 0; i < amount; i++) {
+		int slot_index = (block + i) % CACHE_NUM_SLOTS;
+		struct cache_slot_t *slot = &fs->block_cache[slot_index];
+		pthread_mutex_lock(&slot->lock);
+		if (slot->is_valid && slot->is_dirty && slot->block == block + i)
+			memcpy(buf + i * BLOCK_SIZE, slot->data, BLOCK_SIZE);
+		else if (slot->writebacks != writebacks[slot_index])
+			block_read_r(fs->disk, block + i + fs->superblock->data_start_index, buf + i * BLOCK_SIZE);
+		pthread_mutex_unlock(&slot->lock);
+	}
+}
+
+
+// helper: cache
+static int cache_flush(fs_t fs)
+{
+	for (int i = 0; i < CACHE_NUM_SLOTS; i++) {
+		struct cache_slot_t *slot = &fs->block_cache[i];
+		pthread_mutex_lock(&slot->lock);
+		if (slot->is_valid && slot->is_dirty) {
+			if (block_write_r(fs->disk, slot->block + fs->superblock->data_start_index, slot->data) < 0) {
+				pthread_mutex_unlock(&slot->lock);
+				return -1;
+			}
+			slot->is_dirty = false;
+			__atomic_fetch_add(&slot->writebacks, 1, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&slot->lock);
+	}
+	return 0;
+}
+
+
+// helper: system files are named with SYSFILE_PREFIX
+static bool is_sysfile_name(const char *filename)
+{
+	return strncmp(filename, SYSFILE_PREFIX, strlen(SYSFILE_PREFIX)) == 0;
+}
+
+
+// helper: create
+// Initialize the first empty root directory entry as an empty file
+static int create_entry(fs_t fs, const char *filename)
+{
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if(fs->root_dir_block[i].filename[0] == EMPTY) {	
+
+			// initialize file data 
+			strcpy(fs->root_dir_block[i].filename, filename);
+			fs->root_dir_block[i].file_size     = 0;
+			fs->root_dir_block[i].start_data_block = EOC;
+			fs->root_dir_block[i].flags         = 0;
+
+			fs->chain_cache[i].is_valid   = true;
+			fs->chain_cache[i].may_share  = false;
+			fs->chain_cache[i].tail_block = EOC;
+			fs->chain_cache[i].num_blocks = 0;
+
+			return i;
+		}
+	}
+	fs_error("All files in rootdirectory are taken\n");
+	return -1;
+}
+
+
+// helper: delete
+// Free the chain of a file, up to the first block still shared with another
+// file, and empty its root directory entry
+static void remove_entry(fs_t fs, int file_index)
+{
+	struct rootdirectory_t* the_dir = &fs->root_dir_block[file_index]; 
+
+	release_chain(fs, the_dir->start_data_block);
+
+	// reset file to blank slate
+	memset(the_dir->filename, 0, FS_FILENAME_LEN);
+	the_dir->file_size = 0;
+	the_dir->start_data_block = EOC;
+	fs->chain_cache[file_index].is_valid = false;
+}
+
+
+/*
+Copy-on-write:
+	1. Blocks 0 to last_block of a file's chain must belong to the file only
+	   before being written. The first block with a non-zero reference
+	   count is shared, and so is the rest of the chain after it.
+	2. Copy the chain from the first shared block to last_block into fresh
+	   blocks, and link the copy in front of the rest of the shared chain.
+	3. Blocks which the write covers entirely are not copied, only linked.
+	The chain is walked and the blocks copied under the file lock only:
+	shared blocks are never modified in place, nor freed while reachable
+	from the chain. Only the other files sharing the blocks may change their
+	reference counts at the same time, by unsharing them too: the first
+	shared block is checked again under the allocator lock, when the copy
+	gets linked, and everything starts over if it is not shared anymore.
+*/
+static int unshare_chain(fs_t fs, int file_index, int last_block, size_t offset, size_t count)
+{
+	struct rootdirectory_t *the_dir = &fs->root_dir_block[file_index];
+	struct chain_cache_t *cache = &fs->chain_cache[file_index];
+
+	load_chain_cache(fs, file_index);
+	if (!cache->may_share)
+		return 0;
+
+retry:;
+	// find the first shared block
+	int prev_fat_index = EOC;
+	int cur_fat_index = the_dir->start_data_block;
+	int cur_block = 0;
+	while (cur_block <= last_block &&
+	       __atomic_load_n(&fs->block_refs[cur_fat_index], __ATOMIC_RELAXED) == 0) {
+		prev_fat_index = cur_fat_index;
+		cur_fat_index = fs->FAT_blocks[cur_fat_index].words;
+		cur_block++;
+	}
+	if (cur_block > last_block) {
+		// nothing left to share if the whole chain was walked
+		if (cur_fat_index == EOC)
+			cache->may_share = false;
+		return 0;
+	}
+	int shared_fat_index = cur_fat_index;
+
+	// get all the copies first, so that a full disk leaves the chain intact
+	int num_copies = last_block - cur_block + 1;
+	int *copies = malloc(num_copies * sizeof(int));
+	if (copies == NULL)
+		return -1;
+	for (int i = 0; i < num_copies; i++) {
+		copies[i] = pool_alloc_block(fs);
+		if (copies[i] == -1) {
+			pthread_mutex_lock(&fs->alloc_lock);
+			for (int j = 0; j < i; j++)
+				free_data_block(fs, copies[j]);
+			pthread_mutex_unlock(&fs->alloc_lock);
+			free(copies);
+			fs_error("no free blocks to copy shared blocks");
+			return -1;
+		}
+	}
+
+	// copy the data and link the copies together, none of them is reachable
+	// by another thread yet
+	char bounce_buff[BLOCK_SIZE];
+	for (int i = 0; i < num_copies; i++, cur_block++) {
+		size_t block_start = (size_t)cur_block * BLOCK_SIZE;
+		if (is_hole_block(fs, cur_fat_index)) {
+			set_hole_block(fs, copies[i], true);
+		} else {
+			set_hole_block(fs, copies[i], false);
+			if ((offset > block_start || offset + count < block_start + BLOCK_SIZE) &&
+			    (read_data_block(fs, cur_fat_index, bounce_buff) < 0 ||
+			     block_write_r(fs->disk, copies[i] + fs->superblock->data_start_index, (void*)bounce_buff) < 0)) {
+				// the chain still leads to the shared blocks
+				pthread_mutex_lock(&fs->alloc_lock);
+				for (int j = 0; j < num_copies; j++)
+					free_data_block(fs, copies[j]);
+				pthread_mutex_unlock(&fs->alloc_lock);
+				free(copies);
+				fs_error("failure to copy shared blocks");
+				return -1;
+			}
+		}
+
+		cur_fat_index = fs->FAT_blocks[cur_fat_index].words;
+		if (i < num_copies - 1)
+			fs->FAT_blocks[copies[i]].words = copies[i + 1];
+	}
+
+	pthread_mutex_lock(&fs->alloc_lock);
+	if (fs->block_refs[shared_fat_index] == 0) {
+		for (int i = 0; i < num_copies; i++)
+			free_data_block(fs, copies[i]);
+		pthread_mutex_unlock(&fs->alloc_lock);
+		free(copies);
+		goto retry;
+	}
+
+	// the first shared block loses the reference from the previous block,
+	// and the copy joins the rest of the shared chain
+	// (atomically, since the walk of other files reads them without lock)
+	__atomic_sub_fetch(&fs->block_refs[shared_fat_index], 1, __ATOMIC_RELAXED);
+	fs->FAT_blocks[copies[num_copies - 1]].words = cur_fat_index;
+	if (cur_fat_index != EOC)
+		__atomic_add_fetch(&fs->block_refs[cur_fat_index], 1, __ATOMIC_RELAXED);
+	if (prev_fat_index == EOC)
+		the_dir->start_data_block = copies[0];
+	else
+		fs->FAT_blocks[prev_fat_index].words = copies[0];
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	if (cur_fat_index == EOC) {
+		cache->tail_block = copies[num_copies - 1];
+		cache->may_share = false;
+	}
+
+	free(copies);
+	return 0;
+}
+
+
+// helper: mount
+static int load_block_refs(fs_t fs)
+{
+	fs->block_refs = calloc(fs->superblock->num_data_blocks, sizeof(uint16_t));
+	if (fs->block_refs == NULL)
+		return -1;
+
+	int file_index = locate_file(fs, REFCNT_FILE);
+	if (file_index == -1)
+		return 0;
+
+	size_t size = fs->superblock->num_data_blocks * sizeof(uint16_t);
+	if (file_read_at(fs, &fs->root_dir_block[file_index], 0, fs->block_refs, size) != size)
+		return -1;
+	return 0;
+}
+
+
+// helper: umount
+// Save the reference counts while blocks are shared, remove the system file
+// once nothing is shared anymore
+static int store_block_refs(fs_t fs)
+{
+	bool is_shared = false;
+	for (int i = 0; i < fs->superblock->num_data_blocks; i++) {
+		if (fs->block_refs[i] != 0) {
+			is_shared = true;
+			break;
+		}
+	}
+
+	int file_index = locate_file(fs, REFCNT_FILE);
+	if (!is_shared) {
+		if (file_index != -1)
+			remove_entry(fs, file_index);
+		return 0;
+	}
+
+	if (file_index == -1)
+		file_index = create_entry(fs, REFCNT_FILE);
+	if (file_index == -1)
+		return -1;
+
+	size_t size = fs->superblock->num_data_blocks * sizeof(uint16_t);
+	if (file_write_at(fs, file_index, 0, fs->block_refs, size, 0) != size)
+		return -1;
+	return 0;
+}
+
+
+// helper: delete
+// Free a chain, up to the first block still shared with another file or
+// snapshot. The rest of the chain is reached through the shared block.
+static void release_chain(fs_t fs, int start_data_block)
+{
+	int frst_dta_blk_i = start_data_block;
+
+	pthread_mutex_lock(&fs->alloc_lock);
+	while (frst_dta_blk_i != EOC) {
+		if (fs->block_refs[frst_dta_blk_i] > 0) {
+			fs->block_refs[frst_dta_blk_i]--;
+			break;
+		}
+		uint16_t tmp = fs->FAT_blocks[frst_dta_blk_i].words;
+		free_data_block(fs, frst_dta_blk_i);
+		frst_dta_blk_i = tmp;
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+
+// helper: snapshots
+// Read the frozen root directory of a snapshot, once
+static int load_snapshot(fs_t fs, int snapshot)
+{
+	if (fs->snapshot_dirs[snapshot] != NULL)
+		return 0;
+
+	char snapshot_name[FS_FILENAME_LEN];
+	snprintf(snapshot_name, FS_FILENAME_LEN, SNAPSHOT_FILE, snapshot);
+	int file_index = locate_file(fs, snapshot_name);
+	if (file_index == -1)
+		return -1;
+
+	struct rootdirectory_t *frozen_dir = malloc(BLOCK_SIZE);
+	if (frozen_dir == NULL)
+		return -1;
+	if (file_read_at(fs, &fs->root_dir_block[file_index], 0, frozen_dir, BLOCK_SIZE) != BLOCK_SIZE) {
+		free(frozen_dir);
+		return -1;
+	}
+
+	fs->snapshot_dirs[snapshot] = frozen_dir;
+	return 0;
+}
+
+
+// helper: snapshots
+static bool is_snapshot_busy(fs_t fs, int snapshot)
+{
+	if (fs->view_snapshot == snapshot)
+		return true;
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (fs->fd_table[i].is_used && fs->fd_table[i].dir == fs->snapshot_dirs[snapshot])
+			return true;
+	}
+	return false;
+}
+
+
+// helper: snapshots are read-only, files are only created, deleted and
+// written while the live file system is mounted
+static bool is_live_view(fs_t fs)
+{
+	if (fs->view_snapshot != FS_SNAPSHOT_LIVE) {
+		fs_error("snapshot [%d] mounted read-only", fs->view_snapshot);
+		return false;
+	}
+	return true;
+}
+
+
+// helper: compressed write
+// Take amount free blocks, not linked to any chain yet. Return 0, or -1 if
+// the disk is full
+static int alloc_chunk_blocks(fs_t fs, int *blocks, int amount)
+{
+	for (int i = 0; i < amount; i++) {
+		blocks[i] = pool_alloc_block(fs);
+		if (blocks[i] == -1) {
+			free_chunk_blocks(fs, blocks, i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+// helper: compressed write
+static void free_chunk_blocks(fs_t fs, const int *blocks, int amount)
+{
+	pthread_mutex_lock(&fs->alloc_lock);
+	for (int i = 0; i < amount; i++)
+		free_data_block(fs, blocks[i]);
+	pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+
+// helper: compressed write
+// Replace the old_amount blocks of a chain that follow prev_fat_index with
+// new_blocks, in order, and free them
+static void replace_chain_segment(fs_t fs, int file_index, int prev_fat_index, int old_amount, const int *new_blocks, int new_amount)
+{
+	pthread_mutex_lock(&fs->alloc_lock);
+	for (int i = 0; i < old_amount; i++) {
+		int victim = fs->FAT_blocks[prev_fat_index].words;
+		fs->FAT_blocks[prev_fat_index].words = fs->FAT_blocks[victim].words;
+		free_data_block(fs, victim);
+	}
+	for (int i = new_amount - 1; i >= 0; i--) {
+		fs->FAT_blocks[new_blocks[i]].words = fs->FAT_blocks[prev_fat_index].words;
+		fs->FAT_blocks[prev_fat_index].words = new_blocks[i];
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	fs->chain_cache[file_index].is_valid = false;
+}
+
+
+// helper: compressed read and write
+static int get_chunk_num_blocks(uint16_t chunk_len)
+{
+	return (chunk_len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+
+// helper: chunk cache
+// Return the decompressed chunk whose compressed data starts at block, NULL
+// if it cannot be read. The chunk cache stays locked until
+// chunk_cache_release().
+static char *chunk_cache_get(fs_t fs, int block, uint16_t chunk_len)
+{
+	struct chunk_slot_t *slot = &fs->chunk_cache[block % CHUNK_CACHE_NUM_SLOTS];
+	pthread_mutex_lock(&fs->chunk_lock);
+	if (slot->is_valid && slot->block == block)
+		return slot->data;
+
+	int num_blocks = get_chunk_num_blocks(chunk_len);
+	char *comp_buf = malloc(num_blocks * BLOCK_SIZE);
+	if (comp_buf == NULL)
+		goto fail;
+
+	int cur_fat_index = block;
+	for (int i = 0; i < num_blocks; i++) {
+		if (read_data_block(fs, cur_fat_index, comp_buf + i * BLOCK_SIZE) < 0) {
+			free(comp_buf);
+			goto fail;
+		}
+		cur_fat_index = fs->FAT_blocks[cur_fat_index].words;
+	}
+
+	slot->is_valid = false;
+	if (chunk_len == CHUNK_SIZE) {
+		memcpy(slot->data, comp_buf, CHUNK_SIZE);
+	} else if (lz_decompress(comp_buf, chunk_len, slot->data, CHUNK_SIZE) != CHUNK_SIZE) {
+		fs_error("corrupted compressed chunk at block [%d]", block);
+		free(comp_buf);
+		goto fail;
+	}
+	free(comp_buf);
+
+	slot->is_valid = true;
+	slot->block    = block;
+	return slot->data;
+
+fail:
+	pthread_mutex_unlock(&fs->chunk_lock);
+	return NULL;
+}
+
+
+// helper: chunk cache
+static void chunk_cache_release(fs_t fs)
+{
+	pthread_mutex_unlock(&fs->chunk_lock);
+}
+
+
+// helper: chunk cache
+static void chunk_cache_put(fs_t fs, int block, const char *data)
+{
+	struct chunk_slot_t *slot = &fs->chunk_cache[block % CHUNK_CACHE_NUM_SLOTS];
+	pthread_mutex_lock(&fs->chunk_lock);
+	memcpy(slot->data, data, CHUNK_SIZE);
+	slot->is_valid = true;
+	slot->block    = block;
+	pthread_mutex_unlock(&fs->chunk_lock);
+}
+
+
+// helper: chunk cache
+static void chunk_cache_drop(fs_t fs, int block)
+{
+	struct chunk_slot_t *slot = &fs->chunk_cache[block % CHUNK_CACHE_NUM_SLOTS];
+	pthread_mutex_lock(&fs->chunk_lock);
+	if (slot->is_valid && slot->block == block)
+		slot->is_valid = false;
+	pthread_mutex_unlock(&fs->chunk_lock);
+}
+
+
+// helper: mount
+// Load the block hashes and index the blocks which have one
+static int load_dedup_table(fs_t fs)
+{
+	fs->num_hash_buckets = 1;
+	while (fs->num_hash_buckets < fs->superblock->num_data_blocks)
+		fs->num_hash_buckets *= 2;
+
+	fs->block_hashes = calloc(fs->superblock->num_data_blocks, sizeof(uint32_t));
+	fs->hash_next    = malloc(fs->superblock->num_data_blocks * sizeof(uint16_t));
+	fs->hash_buckets = malloc(fs->num_hash_buckets * sizeof(uint16_t));
+	if (fs->block_hashes == NULL || fs->hash_next == NULL || fs->hash_buckets == NULL)
+		return -1;
+	for (int i = 0; i < fs->num_hash_buckets; i++)
+		fs->hash_buckets[i] = EOC;
+
+	int file_index = locate_file(fs, DEDUP_FILE);
+	if (file_index == -1)
+		return 0;
+
+	uint32_t *hashes = malloc(fs->superblock->num_data_blocks * sizeof(uint32_t));
+	if (hashes == NULL)
+		return -1;
+	size_t size = fs->superblock->num_data_blocks * sizeof(uint32_t);
+	if (file_read_at(fs, &fs->root_dir_block[file_index], 0, hashes, size) != size) {
+		free(hashes);
+		return -1;
+	}
+
+	// the blocks of the system file were written after their hash was
+	// saved, and a hash is only a hint verified before sharing a block:
+	// ignore them and the free blocks
+	int cur_fat_index = fs->root_dir_block[file_index].start_data_block;
+	while (cur_fat_index != EOC) {
+		hashes[cur_fat_index] = 0;
+		cur_fat_index = fs->FAT_blocks[cur_fat_index].words;
+	}
+	for (int i = 1; i < fs->superblock->num_data_blocks; i++) {
+		if (hashes[i] != 0 && fs->FAT_blocks[i].words != EMPTY)
+			dedup_index_insert(fs, i, hashes[i]);
+	}
+	free(hashes);
+	return 0;
+}
+
+
+// helper: umount
+// Save the block hashes while some blocks have one, remove the system file
+// otherwise
+static int store_dedup_table(fs_t fs)
+{
+	bool has_hashes = false;
+	for (int i = 0; i < fs->superblock->num_data_blocks; i++) {
+		if (fs->block_hashes[i] != 0) {
+			has_hashes = true;
+			break;
+		}
+	}
+
+	int file_index = locate_file(fs, DEDUP_FILE);
+	if (!has_hashes) {
+		if (file_index != -1)
+			remove_entry(fs, file_index);
+		return 0;
+	}
+
+	if (file_index == -1)
+		file_index = create_entry(fs, DEDUP_FILE);
+	if (file_index == -1)
+		return -1;
+
+	// the blocks of the system file lose their hash while it is written
+	size_t size = fs->superblock->num_data_blocks * sizeof(uint32_t);
+	if (file_write_at(fs, file_index, 0, fs->block_hashes, size, 0) != size)
+		return -1;
+	return 0;
+}
+
+
+// helper: dedup
+// Fast non-cryptographic hash of a block, never 0
+static uint32_t hash_block(const char *data)
+{
+	uint64_t hash = 0x9e3779b97f4a7c15ULL;
+	for (int i = 0; i < BLOCK_SIZE; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(uint64_t));
+		hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+		hash ^= hash >> 32;
+	}
+	uint32_t folded = (uint32_t)(hash ^ (hash >> 32));
+	return folded ? folded : 1;
+}
+
+
+// helper: dedup
+static void dedup_index_insert(fs_t fs, int block, uint32_t hash)
+{
+	dedup_index_remove(fs, block);
+
+	pthread_mutex_lock(&fs->hash_lock);
+	int bucket = hash & (fs->num_hash_buckets - 1);
+	fs->block_hashes[block] = hash;
+	fs->hash_next[block]    = fs->hash_buckets[bucket];
+	fs->hash_buckets[bucket] = block;
+	pthread_mutex_unlock(&fs->hash_lock);
+}
+
+
+// helper: dedup
+// Only the owner of a block changes its hash, which can be checked unlocked
+static void dedup_index_remove(fs_t fs, int block)
+{
+	if (fs->block_hashes == NULL || fs->block_hashes[block] == 0)
+		return;
+
+	pthread_mutex_lock(&fs->hash_lock);
+	uint16_t *link = &fs->hash_buckets[fs->block_hashes[block] & (fs->num_hash_buckets - 1)];
+	while (*link != block)
+		link = &fs->hash_next[*link];
+	*link = fs->hash_next[block];
+	fs->block_hashes[block] = 0;
+	pthread_mutex_unlock(&fs->hash_lock);
+}
+
+
+/*
+Share the end of a chain with identical blocks:
+	1. Walk the chain of the file. The blocks after the first shared block
+	   already belong to other chains too.
+	2. From the last private block back to the first one, look for a block
+	   of another chain with the same content and the same next block as the
+	   block found for the following position.
+	3. Link the file to the identical chain found for the longest suffix,
+	   and release its own blocks for that suffix.
+*/
+static void dedup_chain(fs_t fs, int file_index)
+{
+	struct rootdirectory_t *the_dir = &fs->root_dir_block[file_index];
+	load_chain_cache(fs, file_index);
+	int num_blocks = fs->chain_cache[file_index].num_blocks;
+	if (num_blocks == 0)
+		return;
+
+	uint16_t *chain   = malloc(num_blocks * sizeof(uint16_t));
+	uint16_t *matches = malloc(num_blocks * sizeof(uint16_t));
+	bool *is_own = calloc(fs->superblock->num_data_blocks, sizeof(bool));
+	char *data  = malloc(BLOCK_SIZE);
+	char *other = malloc(BLOCK_SIZE);
+	if (chain == NULL || matches == NULL || is_own == NULL || data == NULL || other == NULL)
+		goto out;
+
+	int first_shared = num_blocks;
+	int cur_fat_index = the_dir->start_data_block;
+	for (int i = 0; i < num_blocks; i++) {
+		chain[i] = cur_fat_index;
+		is_own[cur_fat_index] = true;
+		if (first_shared == num_blocks && fs->block_refs[cur_fat_index] != 0)
+			first_shared = i;
+		cur_fat_index = fs->FAT_blocks[cur_fat_index].words;
+	}
+
+	int next_fat_index = first_shared < num_blocks ? chain[first_shared] : EOC;
+	int first_match = first_shared;
+	for (int i = first_shared - 1; i >= 0; i--) {
+		bool is_read = false;
+		if (fs->block_hashes[chain[i]] == 0) {
+			if (read_data_block(fs, chain[i], data) < 0)
+				break;
+			dedup_index_insert(fs, chain[i], hash_block(data));
+			is_read = true;
+		}
+
+		uint32_t hash = fs->block_hashes[chain[i]];
+		int match = EOC;
+		for (int x = fs->hash_buckets[hash & (fs->num_hash_buckets - 1)]; x != EOC; x = fs->hash_next[x]) {
+			if (is_own[x] || fs->block_hashes[x] != hash ||
+			    fs->FAT_blocks[x].words != next_fat_index)
+				continue;
+
+			// verify: equal hashes do not make equal blocks, and a
+			// block that cannot be read matches nothing
+			if (!is_read) {
+				if (read_data_block(fs, chain[i], data) < 0)
+					break;
+				is_read = true;
+			}
+			if (read_data_block(fs, x, other) < 0)
+				continue;
+			if (memcmp(data, other, BLOCK_SIZE) == 0) {
+				match = x;
+				break;
+			}
+		}
+		if (match == EOC)
+			break;
+
+		matches[i] = match;
+		next_fat_index = match;
+		first_match = i;
+	}
+
+	if (first_match < first_shared) {
+		if (first_match == 0)
+			the_dir->start_data_block = matches[0];
+		else
+			fs->FAT_blocks[chain[first_match - 1]].words = matches[first_match];
+		fs->block_refs[matches[first_match]]++;
+
+		// the matching blocks belong to chains of other files
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+			fs->chain_cache[i].may_share = true;
+
+		// frees the replaced blocks, and drops the reference of the last
+		// one on the shared rest of the chain
+		release_chain(fs, chain[first_match]);
+		fs->chain_cache[file_index].is_valid = false;
+	}
+
+out:
+	free(chain);
+	free(matches);
+	free(is_own);
+	free(data);
+	free(other);
+}
+
+
+// helper: mount
+static int load_hole_map(fs_t fs)
+{
+	size_t size = (fs->superblock->num_data_blocks + 7) / 8;
+	fs->hole_map = calloc(size, 1);
+	if (fs->hole_map == NULL)
+		return -1;
+
+	int file_index = locate_file(fs, HOLES_FILE);
+	if (file_index == -1)
+		return 0;
+
+	uint8_t *holes = malloc(size);
+	if (holes == NULL)
+		return -1;
+	if (file_read_at(fs, &fs->root_dir_block[file_index], 0, holes, size) != size) {
+		free(holes);
+		return -1;
+	}
+	memcpy(fs->hole_map, holes, size);
+	free(holes);
+
+	// the blocks of the system file were holes until it got written
+	int cur_fat_index = fs->root_dir_block[file_index].start_data_block;
+	while (cur_fat_index != EOC) {
+		set_hole_block(fs, cur_fat_index, false);
+		cur_fat_index = fs->FAT_blocks[cur_fat_index].words;
+	}
+	return 0;
+}
+
+
+// helper: umount
+// Save the holes while there are some, remove the system file otherwise
+static int store_hole_map(fs_t fs)
+{
+	size_t size = (fs->superblock->num_data_blocks + 7) / 8;
+	bool has_holes = false;
+	for (size_t i = 0; i < size; i++) {
+		if (fs->hole_map[i] != 0) {
+			has_holes = true;
+			break;
+		}
+	}
+
+	int file_index = locate_file(fs, HOLES_FILE);
+	if (!has_holes) {
+		if (file_index != -1)
+			remove_entry(fs, file_index);
+		return 0;
+	}
+
+	if (file_index == -1)
+		file_index = create_entry(fs, HOLES_FILE);
+	if (file_index == -1)
+		return -1;
+
+	if (file_write_at(fs, file_index, 0, fs->hole_map, size, 0) != size)
+		return -1;
+	return 0;
+}
+
+
+// helper: holes
+static bool is_hole_block(fs_t fs, int block)
+{
+	if (fs->hole_map == NULL || block == EOC)
+		return false;
+	return (__atomic_load_n(&fs->hole_map[block / 8], __ATOMIC_RELAXED) >> (block % 8)) & 1;
+}
+
+
+// helper: holes
+static void set_hole_block(fs_t fs, int block, bool is_hole)
+{
+	if (fs->hole_map == NULL)
+		return;
+	// the other bits of the byte belong to blocks of other files
+	if (is_hole)
+		__atomic_fetch_or(&fs->hole_map[block / 8], 1 << (block % 8), __ATOMIC_RELAXED);
+	else
+		__atomic_fetch_and(&fs->hole_map[block / 8], ~(1 << (block % 8)), __ATOMIC_RELAXED);
+}
+
+
+// helper: read a whole data block, bypassing the cache but up to date with
+// it. Holes read as zeros. -1 if the disk fails
+static int read_data_block(fs_t fs, int block, char *buf)
+{
+	if (is_hole_block(fs, block)) {
+		memset(buf, 0, BLOCK_SIZE);
+		return 0;
+	}
+	unsigned int writebacks[CACHE_NUM_SLOTS];
+	cache_save_writebacks(fs, writebacks);
+	if (block_read_r(fs->disk, block + fs->superblock->data_start_index, (void*)buf) < 0)
+		return -1;
+	cache_patch_run(fs, block, 1, buf, writebacks);
+	return 0;
+}
+
+
+// helper: import
+// Copy whole blocks from a host file to the physically contiguous runs of the
+// chain. If the host file ends early, the blocks added to the chain for
+// nothing are freed, the others left unwritten stay holes.
+static int import_blocks(fs_t fs, int file_index, size_t offset, int host_fd, size_t count)
+{
+	struct rootdirectory_t *the_dir = &fs->root_dir_block[file_index];
+	load_chain_cache(fs, file_index);
+	int old_num_blocks = fs->chain_cache[file_index].num_blocks;
+	int cur_fat_index;
+	count = reserve_write(fs, file_index, offset, count, &cur_fat_index);
+
+	size_t total_byte_written = 0;
+	while (total_byte_written < count) {
+		int run_length = get_run_length(fs, cur_fat_index, (count - total_byte_written) / BLOCK_SIZE);
+		cache_drop_run(fs, cur_fat_index, run_length);
+		ssize_t ret = block_import_run_r(fs->disk, cur_fat_index + fs->superblock->data_start_index,
+					       run_length, host_fd);
+		if (ret < 0)
+			ret = 0;
+		total_byte_written += ret;
+		if (ret < run_length * BLOCK_SIZE) {
+			for (int i = (ret + BLOCK_SIZE - 1) / BLOCK_SIZE; i < run_length; i++)
+				set_hole_block(fs, cur_fat_index + i, true);
+			break;
+		}
+		cur_fat_index = fs->FAT_blocks[cur_fat_index + run_length - 1].words;
+	}
+
+	if (offset + total_byte_written > the_dir->file_size)
+		the_dir->file_size = offset + total_byte_written;
+
+	int num_blocks = (the_dir->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (num_blocks < old_num_blocks)
+		num_blocks = old_num_blocks;
+	if (num_blocks < fs->chain_cache[file_index].num_blocks) {
+		if (num_blocks == 0) {
+			release_chain(fs, the_dir->start_data_block);
+			the_dir->start_data_block = EOC;
+		} else {
+			int last_fat_index = go_to_cur_FAT_block(fs, the_dir->start_data_block, num_blocks - 1);
+			release_chain(fs, fs->FAT_blocks[last_fat_index].words);
+			__atomic_store_n(&fs->FAT_blocks[last_fat_index].words, EOC, __ATOMIC_RELAXED);
+		}
+		fs->chain_cache[file_index].is_valid = false;
+	}
+	return total_byte_written;
+}
+
+
+// helper: import
+// Copy from a host file through a buffer, until its end
+static int import_buffered(fs_t fs, int file_index, size_t offset, int host_fd, size_t count, int flags)
+{
+	if (count == 0)
+		return 0;
+	char *buf = malloc(HOST_BUF_SIZE);
+	if (buf == NULL)
+		return 0;
+
+	size_t total_byte_written = 0;
+	while (total_byte_written < count) {
+		size_t chunk = count - total_byte_written < HOST_BUF_SIZE ?
+			count - total_byte_written : HOST_BUF_SIZE;
+		ssize_t ret = read(host_fd, buf, chunk);
+		if (ret <= 0)
+			break;
+		int written = file_write_at(fs, file_index, offset + total_byte_written, buf, ret, flags);
+		if (written > 0)
+			total_byte_written += written;
+		if (written < ret)
+			break;
+	}
+
+	free(buf);
+	return total_byte_written;
+}
+
+
+// helper: export
+// Copy to a host file through a buffer
+static int export_buffered(fs_t fs, struct rootdirectory_t *the_dir, size_t offset, int host_fd, size_t count)
+{
+	char *buf = malloc(HOST_BUF_SIZE);
+	if (buf == NULL)
+		return -1;
+
+	size_t total_bytes_read = 0;
+	while (total_bytes_read < count) {
+		size_t chunk = count - total_bytes_read < HOST_BUF_SIZE ?
+			count - total_bytes_read : HOST_BUF_SIZE;
+		int ret = file_read_at(fs, the_dir, offset + total_bytes_read, buf, chunk);
+		if (ret <= 0)
+			break;
+		if (write_host(host_fd, buf, ret) < 0) {
+			free(buf);
+			return -1;
+		}
+		total_bytes_read += ret;
+	}
+
+	free(buf);
+	return total_bytes_read;
+}
+
+
+// helper: export
+// Copy the data blocks of a file to a host file, in the kernel for data runs
+static int export_blocks(fs_t fs, struct rootdirectory_t *the_dir, size_t offset, int host_fd, size_t count)
+{
+	if (offset >= the_dir->file_size)
+		return 0;
+	if (offset + count > the_dir->file_size)
+		count = the_dir->file_size - offset;
+
+	if (cache_flush(fs) < 0)
+		return -1;
+
+	char *zeros = NULL;
+	int FAT_iter = go_to_cur_FAT_block(fs, the_dir->start_data_block, offset / BLOCK_SIZE);
+	size_t location = offset % BLOCK_SIZE;
+	size_t total_bytes_read = 0;
+	while (total_bytes_read < count) {
+		size_t amount_to_read = count - total_bytes_read;
+		int run_length = get_run_length(fs, FAT_iter, (location + amount_to_read + BLOCK_SIZE - 1) / BLOCK_SIZE);
+		size_t left_shift = run_length * BLOCK_SIZE - location;
+		if (left_shift > amount_to_read)
+			left_shift = amount_to_read;
+
+		int ret;
+		if (is_hole_block(fs, FAT_iter)) {
+			if (zeros == NULL)
+				zeros = calloc(1, HOST_BUF_SIZE);
+			ret = -1;
+			for (size_t done = 0; zeros != NULL && done < left_shift; done += HOST_BUF_SIZE) {
+				size_t chunk = left_shift - done < HOST_BUF_SIZE ? left_shift - done : HOST_BUF_SIZE;
+				ret = write_host(host_fd, zeros, chunk);
+				if (ret < 0)
+					break;
+			}
+		} else {
+			ret = block_export_run_r(fs->disk, FAT_iter + fs->superblock->data_start_index, location, left_shift, host_fd);
+		}
+		if (ret < 0) {
+			free(zeros);
+			fs_error("failure to write to host file");
+			return -1;
+		}
+
+		total_bytes_read += left_shift;
+		location = 0;
+		FAT_iter = fs->FAT_blocks[FAT_iter + run_length - 1].words;
+	}
+	free(zeros);
+
+	return total_bytes_read;
+}
+
+
+// helper: export
+static int write_host(int host_fd, const char *buf, size_t count)
+{
+	size_t done = 0;
+	while (done < count) {
+		ssize_t ret = write(host_fd, buf + done, count - done);
+		if (ret < 0)
+			return -1;
+		done += ret;
+	}
+	return 0;
+}
+
+
+// helper: mount
+static void init_locks(fs_t fs)
+{
+	pthread_rwlock_init(&fs->dir_lock, NULL);
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+		pthread_rwlock_init(&fs->file_locks[i], NULL);
+	pthread_mutex_init(&fs->fd_lock, NULL);
+	pthread_mutex_init(&fs->alloc_lock, NULL);
+	pthread_mutex_init(&fs->chunk_lock, NULL);
+	pthread_mutex_init(&fs->hash_lock, NULL);
+	pthread_mutex_init(&fs->pool_list_lock, NULL);
+	for (int i = 0; i < CACHE_NUM_SLOTS; i++)
+		pthread_mutex_init(&fs->block_cache[i].lock, NULL);
+}
+
+
+// helper: umount
+static void destroy_locks(fs_t fs)
+{
+	pthread_rwlock_destroy(&fs->dir_lock);
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+		pthread_rwlock_destroy(&fs->file_locks[i]);
+	pthread_mutex_destroy(&fs->fd_lock);
+	pthread_mutex_destroy(&fs->alloc_lock);
+	pthread_mutex_destroy(&fs->chunk_lock);
+	pthread_mutex_destroy(&fs->hash_lock);
+	pthread_mutex_destroy(&fs->pool_list_lock);
+	for (int i = 0; i < CACHE_NUM_SLOTS; i++)
+		pthread_mutex_destroy(&fs->block_cache[i].lock);
+}
+
+
+// helper: data I/O
+// Lock the directory for reading, then the file of a descriptor, unless it
+// belongs to a snapshot, whose files never change
+static void lock_fd_file(fs_t fs, int fd, bool is_writer)
+{
+	pthread_rwlock_rdlock(&fs->dir_lock);
+	if (fs->fd_table[fd].dir != fs->root_dir_block)
+		return;
+
+	pthread_rwlock_t *file_lock = &fs->file_locks[fs->fd_table[fd].file_index];
+	if (is_writer)
+		pthread_rwlock_wrlock(file_lock);
+	else
+		pthread_rwlock_rdlock(file_lock);
+}
+
+
+// helper: data I/O
+static void unlock_fd_file(fs_t fs, int fd)
+{
+	if (fs->fd_table[fd].dir == fs->root_dir_block)
+		pthread_rwlock_unlock(&fs->file_locks[fs->fd_table[fd].file_index]);
+	pthread_rwlock_unlock(&fs->dir_lock);
+}
@@ -12,6 +12,21 @@
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Maximum number of snapshots */
+#define FS_SNAPSHOT_MAX_COUNT 8
+
+/** Snapshot number of the live file system, for fs_snapshot_mount() */
+#define FS_SNAPSHOT_LIVE -1
+
+/** Open flag: every write is performed at the end of the file */
+#define FS_O_APPEND 0x1
+
+/** Open flag: an empty file stores its data compressed from now on */
+#define FS_O_COMPRESS 0x2
+
+/** Open flag: blocks identical to existing blocks are shared, not stored */
+#define FS_O_DEDUP 0x4
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -72,6 +87,62 @@ int fs_create(const char *filename);
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_clone - Clone a file
+ * @src: Name of the file to clone
+ * @dst: Name of the new file
+ *
+ * Create a new file named @dst in the root directory of the mounted file
+ * system, with the same content as file @src. No data is copied: both files
+ * share the data blocks of @src, and a shared block is only copied when one
+ * of the files writes to it. String @dst follows the same rules as for
+ * fs_create().
+ *
+ * Return: -1 if there is no file named @src, or in the same cases as
+ * fs_create() for @dst. 0 otherwise.
+ */
+int fs_clone(const char *src, const char *dst);
+
+/**
+ * fs_snapshot_create - Create a snapshot of the file system
+ *
+ * Freeze the current content of all the files of the mounted file system as
+ * an immutable version. No data is copied: the snapshot shares the data
+ * blocks of the live files, and the live file system copies a shared block
+ * before modifying it.
+ *
+ * Return: -1 if a snapshot is currently mounted, if there are already
+ * %FS_SNAPSHOT_MAX_COUNT snapshots, or if there is no space left to save the
+ * snapshot. Otherwise return the snapshot number.
+ */
+int fs_snapshot_create(void);
+
+/**
+ * fs_snapshot_mount - Mount a snapshot
+ * @snapshot: Snapshot number, or %FS_SNAPSHOT_LIVE
+ *
+ * Make the files of snapshot @snapshot visible to fs_open() and fs_ls(), in
+ * place of the live files, until the live file system is mounted back with
+ * %FS_SNAPSHOT_LIVE. Files opened from a snapshot are read-only, and files
+ * cannot be created, deleted or cloned while a snapshot is mounted. Files
+ * already open keep accessing their own version.
+ *
+ * Return: -1 if there is no snapshot @snapshot. 0 otherwise.
+ */
+int fs_snapshot_mount(int snapshot);
+
+/**
+ * fs_snapshot_delete - Delete a snapshot
+ * @snapshot: Snapshot number
+ *
+ * Delete snapshot @snapshot, and free the data blocks that only it was still
+ * using.
+ *
+ * Return: -1 if there is no snapshot @snapshot, or if it is currently mounted
+ * or has open files. 0 otherwise.
+ */
+int fs_snapshot_delete(int snapshot);
+
 /**
  * fs_ls - List files on file system
  *
@@ -98,6 +169,36 @@ int fs_ls(void);
  */
 int fs_open(const char *filename);
 
+/**
+ * fs_open_flags - Open a file with flags
+ * @filename: File name
+ * @flags: Bitwise OR of open flags, or 0
+ *
+ * Same as fs_open(), with additional behavior selected by @flags. With
+ * %FS_O_APPEND, every fs_write() on the returned file descriptor first moves
+ * the file offset to the end of the file, so that writes always extend it.
+ * fs_read() and fs_lseek() behave as usual.
+ *
+ * With %FS_O_COMPRESS, a file which is still empty switches to compressed
+ * storage: its data is compressed in fixed-size chunks on fs_write() and
+ * decompressed on fs_read(), transparently. The file stays compressed. The
+ * flag has no effect on a file which already holds data. A compressed file
+ * cannot grow past 32 MiB (2048 chunks of 16 KiB, as many as its chunk map
+ * holds): fs_write() writes fewer bytes than requested, or none, past that
+ * size.
+ *
+ * With %FS_O_DEDUP, the content of every whole block written through the
+ * file descriptor is hashed. When the file descriptor is closed, the blocks
+ * at the end of the file which are identical to blocks of other files (or
+ * snapshots) are replaced by these blocks, which get shared instead of being
+ * stored twice. A shared block is copied when one of the files modifies it.
+ * The flag has no effect on compressed files.
+ *
+ * Return: -1 if @flags contains unknown flags, or in the same cases as
+ * fs_open(). Otherwise return the file descriptor.
+ */
+int fs_open_flags(const char *filename, int flags);
+
 /**
  * fs_close - Close a file
  * @fd: File descriptor
@@ -127,11 +228,15 @@ int fs_stat(int fd);
  *
  * Set the file offset (used for read and write operations) associated with file
  * descriptor @fd to the argument @offset. To append to a file, one can call
- * fs_lseek(fd, fs_stat(fd));
+ * fs_lseek(fd, fs_stat(fd)), or open it with fs_open_flags() and %FS_O_APPEND;
+ *
+ * The offset can be set past the end of the file. A later fs_write() at that
+ * offset extends the file, leaving a hole between the previous end of the
+ * file and @offset. The blocks of a hole are allocated, but never written or
+ * read: they read as zeros.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open), or if @offset is out of bounds (beyond the end of the file). 0
- * otherwise.
+ * open). 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
@@ -150,9 +255,12 @@ int fs_lseek(int fd, size_t offset);
  * runs out of space while performing a write operation, fs_write() should write
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
+ * If the disk fails, the write stops there and the bytes already written are
+ * counted.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). Otherwise return the number of bytes actually written.
+ * open), or if the disk fails before any byte is written. Otherwise return
+ * the number of bytes actually written.
  */
 int fs_write(int fd, void *buf, size_t count);
 
@@ -170,10 +278,142 @@ int fs_write(int fd, void *buf, size_t count);
  * @count bytes until the end of the file (it can even be 0 if the file offset
  * is at the end of the file). The file offset of the file descriptor is
  * implicitly incremented by the number of bytes that were actually read.
+ * If the disk fails, the read stops there and the bytes already read are
+ * counted.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). Otherwise return the number of bytes actually read.
+ * open), or if the disk fails before any byte is read. Otherwise return the
+ * number of bytes actually read.
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_import - Write to a file from a host file
+ * @fd: File descriptor
+ * @host_fd: File descriptor of the host file to read from
+ * @count: Number of bytes of data to be copied
+ *
+ * Same as fs_write(), with the data read from host file @host_fd (at its
+ * current file offset) instead of a buffer. Whole blocks are copied by the
+ * kernel between @host_fd and the virtual disk when possible, without going
+ * through user memory. The copy stops early at the end of @host_fd.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the number of bytes actually written.
+ */
+int fs_import(int fd, int host_fd, size_t count);
+
+/**
+ * fs_export - Read from a file to a host file
+ * @fd: File descriptor
+ * @host_fd: File descriptor of the host file to write to
+ * @count: Number of bytes of data to be copied
+ *
+ * Same as fs_read(), with the data written to host file @host_fd (at its
+ * current file offset, or to the pipe) instead of a buffer. The data is
+ * copied by the kernel between the virtual disk and @host_fd when possible,
+ * without going through user memory.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if writing to @host_fd fails. Otherwise return the number of bytes
+ * actually read.
+ */
+int fs_export(int fd, int host_fd, size_t count);
+
+/**
+ * fs_t - File system instance
+ *
+ * The functions above operate on a single, default file system instance.
+ * Their reentrant variants below, suffixed with _r, take an instance as first
+ * argument and otherwise behave like their counterparts, so that several file
+ * systems can be mounted at the same time. An instance only holds a mounted
+ * file system between fs_mount_r() and fs_umount_r().
+ *
+ * Once mounted, an instance (the default one included) can be used from
+ * several threads at once: reads of different files, or of the same file,
+ * run in parallel, and writes only exclude the other accesses to the same
+ * file. A file descriptor must not be used by several threads at once, and
+ * mounting or unmounting must not race with any other call.
+ */
+typedef struct fs* fs_t;
+
+/**
+ * fs_alloc - Allocate a file system instance
+ *
+ * Return: Pointer to an unmounted instance, or NULL in case of failure
+ */
+fs_t fs_alloc(void);
+
+/**
+ * fs_free - Deallocate a file system instance
+ * @fs: Instance to deallocate
+ *
+ * Return: -1 if @fs is NULL or still mounted. 0 otherwise.
+ */
+int fs_free(fs_t fs);
+
+/**
+ * fs_default - Get the default file system instance
+ *
+ * Return: Pointer to the instance that the functions without the _r suffix
+ * operate on
+ */
+fs_t fs_default(void);
+
+int fs_mount_r(fs_t fs, const char *diskname);
+int fs_umount_r(fs_t fs);
+int fs_info_r(fs_t fs);
+int fs_create_r(fs_t fs, const char *filename);
+int fs_delete_r(fs_t fs, const char *filename);
+int fs_ls_r(fs_t fs);
+int fs_open_r(fs_t fs, const char *filename);
+int fs_open_flags_r(fs_t fs, const char *filename, int flags);
+int fs_close_r(fs_t fs, int fd);
+int fs_stat_r(fs_t fs, int fd);
+int fs_lseek_r(fs_t fs, int fd, size_t offset);
+int fs_write_r(fs_t fs, int fd, void *buf, size_t count);
+int fs_read_r(fs_t fs, int fd, void *buf, size_t count);
+int fs_import_r(fs_t fs, int fd, int host_fd, size_t count);
+int fs_export_r(fs_t fs, int fd, int host_fd, size_t count);
+int fs_clone_r(fs_t fs, const char *src, const char *dst);
+int fs_snapshot_create_r(fs_t fs);
+int fs_snapshot_mount_r(fs_t fs, int snapshot);
+int fs_snapshot_delete_r(fs_t fs, int snapshot);
+
+#ifdef _UTHREAD_PRIVATE
+
+/*
+ * Private fs API
+ *
+ * Only accessible internally by the uthread library
+ */
+
+/*
+ * fs_pwrite_r - Write to a file at a given offset
+ * @fs: Instance
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Same as fs_write_r(), at @offset instead of the file offset of @fd, which
+ * is neither read nor changed. Several threads can therefore use @fd at once.
+ */
+int fs_pwrite_r(fs_t fs, int fd, void *buf, size_t count, size_t offset);
+
+/*
+ * fs_pread_r - Read from a file at a given offset
+ * @fs: Instance
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read at
+ *
+ * Same as fs_read_r(), at @offset instead of the file offset of @fd, which
+ * is neither read nor changed. Several threads can therefore use @fd at once.
+ */
+int fs_pread_r(fs_t fs, int fd, void *buf, size_t count, size_t offset);
+
+#endif /* _UTHREAD_PRIVATE */
+
 #endif /* _FS_H */
@@ -0,0 +1,350 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define _UTHREAD_PRIVATE
+#include "fs.h"
+#include "fsring.h"
+#include "sem.h"
+#include "uthread.h"
+
+typedef enum { false, true } bool;
+
+// Largest number of requests a worker takes from the submission ring at once
+#define FS_RING_BATCH 16
+
+/*
+ * Ring:
+ * The submission and the completion rings have as many entries, a power of
+ * 2, and are indexed with free-running counters. Every submitted request
+ * gets exactly one completion, so a free submission entry also guarantees a
+ * free completion entry.
+ *
+ * The rings are shared by the uthreads under the ring's mutex, which the
+ * workers release while executing their batch.
+ *
+ *	sq_head <= sq_submitted <= sq_tail: taken by a worker, handed over by
+ *	fs_ring_submit(), queued by fs_ring_get_sqe()
+ *	cq_head <= cq_tail: reaped, completed
+ */
+struct fs_ring {
+	fs_t          fs;
+	unsigned int  entries;
+	struct fs_sqe *sqes;
+	struct fs_cqe *cqes;
+	unsigned int  sq_head;
+	unsigned int  sq_submitted;
+	unsigned int  sq_tail;
+	unsigned int  cq_head;
+	unsigned int  cq_tail;
+	mutex_t       lock;
+	cond_t        submitted;      // idle workers wait for the next submission
+	cond_t        completed;      // waiters wait for the next completion
+	int           num_workers;
+	uthread_t     *workers;       // joined by fs_ring_destroy()
+	bool          is_stopping;
+};
+
+
+// private API
+static void fs_ring_worker(void *arg);
+static void sort_batch(struct fs_sqe *batch, int amount);
+static int  get_sort_phase(int op);
+static bool is_sorted_before(struct fs_sqe *a, struct fs_sqe *b);
+static int  execute_sqe(fs_t fs, struct fs_sqe *sqe);
+static int  peek_cqe(struct fs_ring *ring, struct fs_cqe *cqe);
+
+
+/*
+Create a ring:
+	1. Allocate both rings, with a power of 2 entries.
+	2. Start the worker uthreads, which block until requests get submitted.
+*/
+fs_ring_t fs_ring_create_r(fs_t fs, unsigned int entries, int nworkers)
+{
+	if (fs == NULL || entries == 0 || nworkers <= 0)
+		return NULL;
+
+	struct fs_ring *ring = calloc(1, sizeof(struct fs_ring));
+	if (ring == NULL)
+		return NULL;
+
+	ring->fs = fs;
+	ring->entries = 1;
+	while (ring->entries < entries)
+		ring->entries *= 2;
+	ring->sqes = malloc(ring->entries * sizeof(struct fs_sqe));
+	ring->cqes = malloc(ring->entries * sizeof(struct fs_cqe));
+	ring->lock = mutex_create();
+	ring->submitted = cond_create();
+	ring->completed = cond_create();
+	ring->workers = malloc(nworkers * sizeof(uthread_t));
+	if (ring->sqes == NULL || ring->cqes == NULL || ring->lock == NULL ||
+	    ring->submitted == NULL || ring->completed == NULL ||
+	    ring->workers == NULL)
+		goto fail;
+
+	for (int i = 0; i < nworkers; i++) {
+		uthread_t tid = uthread_create(fs_ring_worker, ring);
+		if (tid == -1)
+			break;
+		ring->workers[ring->num_workers++] = tid;
+	}
+	if (ring->num_workers == 0)
+		goto fail;
+
+	return ring;
+
+fail:
+	free(ring->sqes);
+	free(ring->cqes);
+	if (ring->lock)
+		mutex_destroy(ring->lock);
+	if (ring->submitted)
+		cond_destroy(ring->submitted);
+	if (ring->completed)
+		cond_destroy(ring->completed);
+	free(ring->workers);
+	free(ring);
+	return NULL;
+}
+
+
+fs_ring_t fs_ring_create(unsigned int entries, int nworkers)
+{
+	return fs_ring_create_r(fs_default(), entries, nworkers);
+}
+
+
+/*
+Destroy a ring:
+	1. Every request must have been reaped.
+	2. Wake the idle workers up so that they exit, and wait for all of them.
+*/
+int fs_ring_destroy(fs_ring_t ring)
+{
+	if (ring == NULL)
+		return -1;
+
+	mutex_lock(ring->lock);
+	if (ring->sq_tail != ring->cq_head) {
+		mutex_unlock(ring->lock);
+		return -1;
+	}
+	ring->is_stopping = true;
+	cond_broadcast(ring->submitted);
+	mutex_unlock(ring->lock);
+
+	for (int i = 0; i < ring->num_workers; i++)
+		uthread_join(ring->workers[i], NULL);
+
+	free(ring->sqes);
+	free(ring->cqes);
+	mutex_destroy(ring->lock);
+	cond_destroy(ring->submitted);
+	cond_destroy(ring->completed);
+	free(ring->workers);
+	free(ring);
+	return 0;
+}
+
+
+struct fs_sqe *fs_ring_get_sqe(fs_ring_t ring)
+{
+	if (ring == NULL)
+		return NULL;
+
+	mutex_lock(ring->lock);
+	if (ring->sq_tail - ring->cq_head >= ring->entries) {
+		mutex_unlock(ring->lock);
+		return NULL;
+	}
+	struct fs_sqe *sqe = &ring->sqes[ring->sq_tail++ & (ring->entries - 1)];
+	mutex_unlock(ring->lock);
+
+	memset(sqe, 0, sizeof(struct fs_sqe));
+	sqe->offset = FS_RING_CUR_OFFSET;
+	return sqe;
+}
+
+
+int fs_ring_submit(fs_ring_t ring)
+{
+	if (ring == NULL)
+		return -1;
+
+	mutex_lock(ring->lock);
+	int amount = ring->sq_tail - ring->sq_submitted;
+	ring->sq_submitted = ring->sq_tail;
+	if (amount > 0)
+		cond_broadcast(ring->submitted);
+	mutex_unlock(ring->lock);
+	return amount;
+}
+
+
+int fs_ring_peek_cqe(fs_ring_t ring, struct fs_cqe *cqe)
+{
+	if (ring == NULL)
+		return -1;
+
+	mutex_lock(ring->lock);
+	int ret = peek_cqe(ring, cqe);
+	mutex_unlock(ring->lock);
+	return ret;
+}
+
+
+int fs_ring_wait_cqe(fs_ring_t ring, struct fs_cqe *cqe)
+{
+	if (ring == NULL)
+		return -1;
+
+	mutex_lock(ring->lock);
+	while (peek_cqe(ring, cqe) == -1) {
+		// nothing in flight, nothing to wait for
+		if (ring->sq_submitted == ring->cq_tail) {
+			mutex_unlock(ring->lock);
+			return -1;
+		}
+		cond_wait(ring->completed, ring->lock);
+	}
+	mutex_unlock(ring->lock);
+	return 0;
+}
+
+
+/*
+FS worker uthread:
+	1. Block while there is nothing submitted.
+	2. Take a batch of submitted requests, and order it so that the disk is
+	   accessed by file and by offset.
+	3. Execute the batch, post the completions and wake the waiters up.
+	4. Yield, so that the completions get reaped while other workers run.
+*/
+static void fs_ring_worker(void *arg)
+{
+	struct fs_ring *ring = arg;
+	struct fs_sqe batch[FS_RING_BATCH];
+	int results[FS_RING_BATCH];
+
+	mutex_lock(ring->lock);
+	while (true) {
+		if (ring->sq_head == ring->sq_submitted) {
+			if (ring->is_stopping)
+				break;
+			cond_wait(ring->submitted, ring->lock);
+			continue;
+		}
+
+		int amount = ring->sq_submitted - ring->sq_head;
+		if (amount > FS_RING_BATCH)
+			amount = FS_RING_BATCH;
+		for (int i = 0; i < amount; i++)
+			batch[i] = ring->sqes[ring->sq_head++ & (ring->entries - 1)];
+		mutex_unlock(ring->lock);
+
+		sort_batch(batch, amount);
+		for (int i = 0; i < amount; i++)
+			results[i] = execute_sqe(ring->fs, &batch[i]);
+
+		mutex_lock(ring->lock);
+		for (int i = 0; i < amount; i++) {
+			struct fs_cqe *cqe = &ring->cqes[ring->cq_tail & (ring->entries - 1)];
+			cqe->result    = results[i];
+			cqe->user_data = batch[i].user_data;
+			ring->cq_tail++;
+		}
+		cond_broadcast(ring->completed);
+		mutex_unlock(ring->lock);
+
+		uthread_yield();
+		mutex_lock(ring->lock);
+	}
+	mutex_unlock(ring->lock);
+}
+
+
+// helper: worker
+// Stable insertion sort, batches are small
+static void sort_batch(struct fs_sqe *batch, int amount)
+{
+	for (int i = 1; i < amount; i++) {
+		struct fs_sqe sqe = batch[i];
+		int j = i;
+		while (j > 0 && is_sorted_before(&sqe, &batch[j - 1])) {
+			batch[j] = batch[j - 1];
+			j--;
+		}
+		batch[j] = sqe;
+	}
+}
+
+
+// helper: worker
+// Opens come first and closes last, so that independent requests on the
+// same file never run on a closed file descriptor
+static int get_sort_phase(int op)
+{
+	switch (op) {
+	case FS_OP_OPEN:  return 0;
+	case FS_OP_READ:
+	case FS_OP_WRITE: return 1;
+	case FS_OP_STAT:  return 2;
+	default:          return 3;
+	}
+}
+
+
+// helper: worker
+// Reads and writes are ordered by file descriptor, then by offset. Requests
+// at the current file offset keep their order, after the others.
+static bool is_sorted_before(struct fs_sqe *a, struct fs_sqe *b)
+{
+	int phase_a = get_sort_phase(a->op);
+	int phase_b = get_sort_phase(b->op);
+	if (phase_a != phase_b)
+		return phase_a < phase_b;
+	if (phase_a != 1)
+		return false;
+	if (a->fd != b->fd)
+		return a->fd < b->fd;
+	return a->offset < b->offset;
+}
+
+
+// helper: worker
+// Requests at an offset leave the file offset alone, so that the workers can
+// run them in parallel on the same file descriptor
+static int execute_sqe(fs_t fs, struct fs_sqe *sqe)
+{
+	switch (sqe->op) {
+	case FS_OP_OPEN:
+		return fs_open_flags_r(fs, sqe->filename, sqe->flags);
+	case FS_OP_READ:
+		if (sqe->offset != FS_RING_CUR_OFFSET)
+			return fs_pread_r(fs, sqe->fd, sqe->buf, sqe->count, sqe->offset);
+		return fs_read_r(fs, sqe->fd, sqe->buf, sqe->count);
+	case FS_OP_WRITE:
+		if (sqe->offset != FS_RING_CUR_OFFSET)
+			return fs_pwrite_r(fs, sqe->fd, sqe->buf, sqe->count, sqe->offset);
+		return fs_write_r(fs, sqe->fd, sqe->buf, sqe->count);
+	case FS_OP_CLOSE:
+		return fs_close_r(fs, sqe->fd);
+	case FS_OP_STAT:
+		return fs_stat_r(fs, sqe->fd);
+	default:
+		return -1;
+	}
+}
+
+
+// helper: reap a completion, with the ring's mutex held
+static int peek_cqe(struct fs_ring *ring, struct fs_cqe *cqe)
+{
+	if (ring->cq_head == ring->cq_tail)
+		return -1;
+
+	*cqe = ring->cqes[ring->cq_head++ & (ring->entries - 1)];
+	return 0;
+}
@@ -0,0 +1,150 @@
+#ifndef _FSRING_H
+#define _FSRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fs.h"
+
+/*
+ * Asynchronous file system interface
+ *
+ * Requests for fs_open(), fs_read(), fs_write(), fs_close() and fs_stat() are
+ * queued in a submission ring, executed in batches by FS worker uthreads, and
+ * their results are reaped from a completion ring. A ring can only be used
+ * from uthreads, once a file system is mounted.
+ *
+ * Requests submitted together must be independent of each other: a batch
+ * runs its opens first and its closes last, with the reads and writes in
+ * between ordered by file and offset, and completions come in that order.
+ * With several worker pthreads (see uthread_workers_config()), the batches
+ * taken by different workers also run in parallel.
+ */
+
+/* Operations */
+enum {
+	FS_OP_OPEN,
+	FS_OP_READ,
+	FS_OP_WRITE,
+	FS_OP_CLOSE,
+	FS_OP_STAT,
+};
+
+/* Offset of a read or write request at the current file offset */
+#define FS_RING_CUR_OFFSET ((size_t)-1)
+
+/*
+ * fs_sqe - Submission queue entry
+ * @op: Operation (FS_OP_*)
+ * @fd: File descriptor, for all operations but FS_OP_OPEN
+ * @filename: File name, for FS_OP_OPEN
+ * @flags: Open flags, for FS_OP_OPEN (see fs_open_flags())
+ * @buf: Data buffer, for FS_OP_READ and FS_OP_WRITE
+ * @count: Number of bytes, for FS_OP_READ and FS_OP_WRITE
+ * @offset: File offset of a read or write, or %FS_RING_CUR_OFFSET. A read or
+ *          write at an offset leaves the file offset of @fd unchanged.
+ * @user_data: Value passed back as is in the completion
+ */
+struct fs_sqe {
+	int op;
+	int fd;
+	const char *filename;
+	int flags;
+	void *buf;
+	size_t count;
+	size_t offset;
+	uint64_t user_data;
+};
+
+/*
+ * fs_cqe - Completion queue entry
+ * @result: Return value of the operation
+ * @user_data: Value of the request
+ */
+struct fs_cqe {
+	int result;
+	uint64_t user_data;
+};
+
+/*
+ * fs_ring_t - Ring type
+ */
+typedef struct fs_ring* fs_ring_t;
+
+/*
+ * fs_ring_create - Create a ring and its worker uthreads
+ * @entries: Maximum number of requests in flight (rounded up to a power of 2)
+ * @nworkers: Number of FS worker uthreads
+ *
+ * The worker uthreads are in the scheduling class of the calling uthread (see
+ * uthread_set_class()), so that a ring serving foreground requests does not
+ * wait behind background work.
+ *
+ * Return: Pointer to the ring, or NULL in case of failure
+ */
+fs_ring_t fs_ring_create(unsigned int entries, int nworkers);
+
+/*
+ * fs_ring_create_r - Create a ring for a file system instance
+ * @fs: File system instance that the requests operate on
+ * @entries: Maximum number of requests in flight (rounded up to a power of 2)
+ * @nworkers: Number of FS worker uthreads
+ *
+ * Same as fs_ring_create(), which operates on the default instance.
+ *
+ * Return: Pointer to the ring, or NULL in case of failure
+ */
+fs_ring_t fs_ring_create_r(fs_t fs, unsigned int entries, int nworkers);
+
+/*
+ * fs_ring_destroy - Stop the worker uthreads and deallocate a ring
+ * @ring: Ring to deallocate
+ *
+ * Return: -1 if @ring is NULL or still has requests in flight or completions
+ * to reap, 0 otherwise
+ */
+int fs_ring_destroy(fs_ring_t ring);
+
+/*
+ * fs_ring_get_sqe - Get the next free submission queue entry
+ * @ring: Ring
+ *
+ * The entry is queued, but only gets executed after fs_ring_submit().
+ *
+ * Return: Pointer to the entry, or NULL if @ring already has as many requests
+ * in flight (or completions to reap) as its number of entries
+ */
+struct fs_sqe *fs_ring_get_sqe(fs_ring_t ring);
+
+/*
+ * fs_ring_submit - Submit the queued entries
+ * @ring: Ring
+ *
+ * Hand the entries queued since the last submission over to the worker
+ * uthreads. They run once the caller blocks in fs_ring_wait_cqe() or yields.
+ *
+ * Return: Number of submitted entries, or -1 if @ring is NULL
+ */
+int fs_ring_submit(fs_ring_t ring);
+
+/*
+ * fs_ring_peek_cqe - Reap a completion, if there is one
+ * @ring: Ring
+ * @cqe: Completion to fill out
+ *
+ * Return: 0 if a completion was reaped, -1 otherwise
+ */
+int fs_ring_peek_cqe(fs_ring_t ring, struct fs_cqe *cqe);
+
+/*
+ * fs_ring_wait_cqe - Reap a completion, waiting for one if needed
+ * @ring: Ring
+ * @cqe: Completion to fill out
+ *
+ * The calling uthread is blocked until a worker completes a request.
+ *
+ * Return: 0 if a completion was reaped, -1 if there is no request in flight
+ */
+int fs_ring_wait_cqe(fs_ring_t ring, struct fs_cqe *cqe);
+
+#endif /* _FSRING_H */
@@ -0,0 +1,190 @@
+#include <stdint.h>
+#include <string.h>
+
+#define _UTHREAD_PRIVATE
+#include "lz.h"
+
+/* Shortest match worth a back-reference */
+#define LZ_MIN_MATCH 4
+
+/* Farthest back-reference */
+#define LZ_MAX_OFFSET 65535
+
+/* The last literals of a buffer are never part of a match */
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+/* Size of the hash table of recent positions (log2) */
+#define LZ_HASH_LOG 12
+
+static uint32_t lz_read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t lz_hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+/*
+ * lz_put_length - Write the part of a length which does not fit in a token
+ * nibble, as a series of bytes ending with a byte below 255
+ */
+static uint8_t *lz_put_length(uint8_t *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+/*
+ * lz_put_sequence - Write a sequence: @lit_len literals from @lit, followed by
+ * a match of @match_len bytes at distance @offset (no match if @match_len is
+ * 0, for the last sequence)
+ *
+ * Return: pointer past the sequence, or NULL if it does not fit before @oend
+ */
+static uint8_t *lz_put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+				size_t lit_len, size_t offset, size_t match_len)
+{
+	/* Worst case: token, length bytes, literals, offset, length bytes */
+	if ((size_t)(oend - op) < 1 + lit_len / 255 + 1 + lit_len + 2 +
+	    match_len / 255 + 1)
+		return NULL;
+
+	uint8_t *token = op++;
+	*token = (lit_len >= 15 ? 15 : lit_len) << 4;
+	if (lit_len >= 15)
+		op = lz_put_length(op, lit_len - 15);
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	if (match_len == 0)
+		return op;
+
+	*op++ = offset & 0xFF;
+	*op++ = offset >> 8;
+	match_len -= LZ_MIN_MATCH;
+	*token |= match_len >= 15 ? 15 : match_len;
+	if (match_len >= 15)
+		op = lz_put_length(op, match_len - 15);
+
+	return op;
+}
+
+size_t lz_compress(const void *src, size_t src_len, void *dst, size_t dst_cap)
+{
+	const uint8_t *base = src;
+	const uint8_t *ip = base, *anchor = base;
+	const uint8_t *iend = base + src_len;
+	uint8_t *op = dst, *oend = op + dst_cap;
+
+	/* Last position seen for each hash, plus one (0 for none) */
+	uint16_t table[1 << LZ_HASH_LOG];
+	memset(table, 0, sizeof(table));
+
+	if (src_len > LZ_MAX_OFFSET)
+		return 0;
+
+	while (src_len >= LZ_MATCH_LIMIT && ip < iend - LZ_MATCH_LIMIT) {
+		uint32_t h = lz_hash(lz_read32(ip));
+		uint16_t candidate = table[h];
+
+		table[h] = ip - base + 1;
+		if (!candidate || lz_read32(base + candidate - 1) != lz_read32(ip)) {
+			ip++;
+			continue;
+		}
+		const uint8_t *match = base + candidate - 1;
+
+		/* Extend the match as far as possible */
+		const uint8_t *mp = ip + LZ_MIN_MATCH;
+		const uint8_t *mm = match + LZ_MIN_MATCH;
+		while (mp < iend - LZ_LAST_LITERALS && *mp == *mm) {
+			mp++;
+			mm++;
+		}
+
+		op = lz_put_sequence(op, oend, anchor, ip - anchor, ip - match,
+				     mp - ip);
+		if (!op)
+			return 0;
+		ip = anchor = mp;
+	}
+
+	op = lz_put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+	if (!op)
+		return 0;
+
+	return op - (uint8_t *)dst;
+}
+
+/*
+ * lz_get_length - Read the rest of a length which did not fit in a token nibble
+ *
+ * Return: 0 if the length runs past @iend, 1 otherwise
+ */
+static int lz_get_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= iend)
+			return 0;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return 1;
+}
+
+int lz_decompress(const void *src, size_t src_len, void *dst, size_t dst_cap)
+{
+	const uint8_t *ip = src, *iend = ip + src_len;
+	uint8_t *op = dst, *oend = op + dst_cap;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+
+		/* Literals */
+		size_t lit_len = token >> 4;
+		if (lit_len == 15 && !lz_get_length(&ip, iend, &lit_len))
+			return -1;
+		if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		/* The last sequence has no match */
+		if (ip == iend)
+			break;
+
+		/* Match, which may overlap the bytes it produces */
+		if (iend - ip < 2)
+			return -1;
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst))
+			return -1;
+
+		size_t match_len = token & 15;
+		if (match_len == 15 && !lz_get_length(&ip, iend, &match_len))
+			return -1;
+		match_len += LZ_MIN_MATCH;
+		if (match_len > (size_t)(oend - op))
+			return -1;
+
+		const uint8_t *match = op - offset;
+		while (match_len--)
+			*op++ = *match++;
+	}
+
+	return op - (uint8_t *)dst;
+}
@@ -0,0 +1,42 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h>
+
+#ifdef _UTHREAD_PRIVATE
+
+/*
+ * Fast LZ77 compression, using the LZ4 block format: a sequence of literal
+ * runs, each followed by a back-reference to a match of at least 4 bytes
+ * within the previous 64 KiB. Favors speed over ratio.
+ */
+
+/**
+ * lz_compress - Compress a buffer
+ * @src: Data to compress
+ * @src_len: Number of bytes in @src (at most 65535)
+ * @dst: Buffer to be filled with compressed data
+ * @dst_cap: Size of buffer @dst
+ *
+ * Return: the number of compressed bytes in @dst, or 0 if the compressed data
+ * does not fit in @dst_cap bytes.
+ */
+size_t lz_compress(const void *src, size_t src_len, void *dst, size_t dst_cap);
+
+/**
+ * lz_decompress - Decompress a buffer
+ * @src: Data compressed with lz_compress()
+ * @src_len: Number of bytes in @src
+ * @dst: Buffer to be filled with decompressed data
+ * @dst_cap: Size of buffer @dst
+ *
+ * Return: the number of decompressed bytes in @dst, or -1 if @src is corrupted
+ * or decompresses to more than @dst_cap bytes.
+ */
+int lz_decompress(const void *src, size_t src_len, void *dst, size_t dst_cap);
+
+#else
+#error "Private header, can't be included from applications directly"
+#endif
+
+#endif /* _LZ_H */
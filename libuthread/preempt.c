@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define _UTHREAD_PRIVATE
+#include "preempt.h"
+#include "uthread.h"
+
+/*
+ * Preemption:
+ * Every worker pthread running the uthreads has its own timer, whose signal
+ * is sent to that pthread only, so the other pthreads of the application are
+ * never interrupted. The state is per pthread: a nesting depth of
+ * preempt_disable() calls, saved in the TCB of a uthread across its context
+ * switches, and a flag recording a tick that arrived while preemption was
+ * disabled.
+ *
+ * The handler yields right away, switching to another thread before
+ * returning. The signal is not blocked while it runs (SA_NODEFER), as context
+ * switches leave the signal mask as is: otherwise the next threads would run
+ * with the signal blocked, until the preempted one returns from the handler.
+ */
+#define PREEMPT_SIGNAL SIGVTALRM
+
+static __thread volatile sig_atomic_t preempt_depth;
+static __thread volatile sig_atomic_t preempt_pending;
+
+static __thread timer_t preempt_timer;
+static __thread int     is_started;
+static struct sigaction saved_action;
+static int              num_started;   // pthreads with a timer (atomic)
+
+
+static void preempt_handler(int signum)
+{
+	if (preempt_depth > 0) {
+		preempt_pending = 1;
+		return;
+	}
+	uthread_yield();
+}
+
+
+void preempt_start(unsigned int slice_us)
+{
+	struct sigaction action;
+	struct sigevent event;
+	struct itimerspec slice;
+
+	if (slice_us == 0 || is_started)
+		return;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = preempt_handler;
+	action.sa_flags = SA_RESTART | SA_NODEFER;
+	sigemptyset(&action.sa_mask);
+	if (__atomic_fetch_add(&num_started, 1, __ATOMIC_SEQ_CST) == 0 &&
+	    sigaction(PREEMPT_SIGNAL, &action, &saved_action)) {
+		perror("sigaction");
+		exit(1);
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.sigev_notify = SIGEV_THREAD_ID;
+	event.sigev_signo = PREEMPT_SIGNAL;
+	event._sigev_un._tid = gettid();
+	if (timer_create(CLOCK_MONOTONIC, &event, &preempt_timer)) {
+		perror("timer_create");
+		exit(1);
+	}
+
+	slice.it_interval.tv_sec = slice_us / 1000000;
+	slice.it_interval.tv_nsec = (slice_us % 1000000) * 1000;
+	slice.it_value = slice.it_interval;
+	if (timer_settime(preempt_timer, 0, &slice, NULL)) {
+		perror("timer_settime");
+		exit(1);
+	}
+	is_started = 1;
+}
+
+
+void preempt_stop(void)
+{
+	if (!is_started)
+		return;
+
+	timer_delete(preempt_timer);
+	if (__atomic_sub_fetch(&num_started, 1, __ATOMIC_SEQ_CST) == 0)
+		sigaction(PREEMPT_SIGNAL, &saved_action, NULL);
+	preempt_pending = 0;
+	is_started = 0;
+}
+
+
+void preempt_disable(void)
+{
+	preempt_depth++;
+}
+
+
+void preempt_enable(void)
+{
+	if (--preempt_depth == 0 && preempt_pending) {
+		preempt_pending = 0;
+		uthread_yield();
+	}
+}
+
+
+int preempt_save(void)
+{
+	preempt_pending = 0;
+	return preempt_depth;
+}
+
+
+void preempt_restore(int depth)
+{
+	preempt_depth = depth;
+}
@@ -0,0 +1,66 @@
+#ifndef _PREEMPT_H
+#define _PREEMPT_H
+
+#include "uthread.h"
+
+#ifdef _UTHREAD_PRIVATE
+
+/*
+ * preempt_start - Start thread preemption
+ * @slice_us: Time slice, in microseconds
+ *
+ * A timer interrupts the calling pthread every @slice_us microseconds, and
+ * forces the running uthread to yield, unless preemption is disabled.
+ */
+void preempt_start(unsigned int slice_us);
+
+/*
+ * preempt_stop - Stop thread preemption
+ */
+void preempt_stop(void);
+
+/*
+ * preempt_disable - Disable preemption
+ *
+ * Calls nest: preemption is enabled again by as many calls to
+ * preempt_enable(). A timer tick while disabled preempts the running uthread
+ * as soon as preemption is enabled again.
+ */
+void preempt_disable(void);
+
+/*
+ * preempt_enable - Enable preemption
+ */
+void preempt_enable(void);
+
+/*
+ * preempt_save - Save the preemption state of the running uthread
+ *
+ * To be called right before a context switch, which also satisfies any
+ * pending preemption.
+ *
+ * Return: Number of nested preempt_disable() calls
+ */
+int preempt_save(void);
+
+/*
+ * preempt_restore - Restore the preemption state of the running uthread
+ * @depth: Value returned by preempt_save(), or 0 for a new uthread
+ */
+void preempt_restore(int depth);
+
+/* Preemption stays disabled until the end of the enclosing scope */
+static inline void preempt_scope_end(int *unused)
+{
+	preempt_enable();
+}
+
+#define PREEMPT_DISABLE_SCOPE() \
+	int __preempt_scope __attribute__((cleanup(preempt_scope_end), unused)) = \
+		(preempt_disable(), 0)
+
+#else
+#error "Private header, can't be included from applications directly"
+#endif
+
+#endif /* _PREEMPT_H */
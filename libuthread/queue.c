@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <stdio.h>
 #include "queue.h"
@@ -17,8 +18,21 @@ struct node {
 struct queue {
 	node *back, *front;
 	int size;
+
+	// ring buffer instead of list, when ring is set
+	void **ring;
+	int head;          // index of the front item
+	int capacity;      // power of two
 };
 
+// Default initial capacity of a ring buffer
+#define QUEUE_RING_CAPACITY 16
+
+static int ring_enqueue(queue_t queue, void *data);
+static int ring_dequeue(queue_t queue, void **data);
+static int ring_delete(queue_t queue, void *data);
+static int ring_iterate(queue_t queue, queue_func_t func);
+
 bool queue_empty(queue_t queue)
 {
 	return queue_length(queue) == 0;
@@ -56,16 +70,46 @@ queue_t queue_create(void)
 	queue_t q = malloc(sizeof(struct queue));
 	q->back = q->front = NULL;
 	q->size = 0;
+	q->ring = NULL;
+	return q;
+}
+
+queue_t queue_create_ring(int capacity)
+{
+	int ring_capacity = QUEUE_RING_CAPACITY;
+	if (capacity > 0) {
+		// round up to a power of two
+		ring_capacity = 1;
+		while (ring_capacity < capacity)
+			ring_capacity <<= 1;
+	}
+
+	queue_t q = malloc(sizeof(struct queue));
+	if (q == NULL) return NULL;
+	q->ring = malloc(ring_capacity * sizeof(void *));
+	if (q->ring == NULL) {
+		free(q);
+		return NULL;
+	}
+	q->back = q->front = NULL;
+	q->size = 0;
+	q->head = 0;
+	q->capacity = ring_capacity;
 	return q;
 }
 
 int queue_destroy(queue_t queue)
 {
 	if (queue == NULL) return -1;
-	while(!queue_empty(queue)) {
-		free(queue_front(queue));
-		queue_pop(queue);
+
+	// the items belong to the caller, only the queue is deallocated
+	if (queue->ring) {
+		free(queue->ring);
+	} else {
+		while(!queue_empty(queue))
+			queue_pop(queue);
 	}
+	free(queue);
 	return 0;
 }
 
@@ -74,6 +118,7 @@ int queue_enqueue(queue_t queue, void *data)
 	// invalid data or queue
 	if ( data == NULL 
 	     || queue == NULL) return -1;
+	if (queue->ring) return ring_enqueue(queue, data);
 
 	// create new node, and assign data
 	node *newNode = malloc(sizeof(node));
@@ -103,6 +148,7 @@ int queue_dequeue(queue_t queue, void **data)
 {
 	if (queue_empty(queue)
 		|| queue == NULL) return -1;
+	if (queue->ring) return ring_dequeue(queue, data);
 
 	// save the data to use in context
 	// swtich in yield
@@ -125,6 +171,8 @@ int queue_dequeue(queue_t queue, void **data)
 
 int queue_delete(queue_t queue, void *data)
 {
+	if (queue == NULL) return -1;
+	if (queue->ring) return ring_delete(queue, data);
 	if (queue_empty(queue)) return 0;
 
 	node *iter = queue->front;
@@ -147,15 +195,17 @@ int queue_delete(queue_t queue, void *data)
 			found = true;
 
 			node *temp_rm = iter;
-			iter->prev->next = temp_rm->next;
-			iter->next->prev = temp_rm->prev;
+			if (iter->prev) iter->prev->next = temp_rm->next;
+			else queue->front = temp_rm->next;
+			if (iter->next) iter->next->prev = temp_rm->prev;
+			else queue->back = temp_rm->prev;
 
 			free(temp_rm);
+			queue->size--;
 			break;
 		}
 		iter = iter->next;
 	}
-	queue->size--;
 	return found ? 0 : -1;
 }
 
@@ -163,6 +213,7 @@ int queue_iterate(queue_t queue, queue_func_t func)
 {
 	if(queue == NULL 
 	  || func == NULL) return -1;
+	if (queue->ring) return ring_iterate(queue, func);
 	
 	node *iter = queue->front;
 	node *iter_cp = NULL;
@@ -189,6 +240,70 @@ int queue_length(queue_t queue)
 	return queue->size;
 }
 
+// Item at position i from the front of a ring buffer
+#define RING_ITEM(queue, i) \
+	((queue)->ring[((queue)->head + (i)) & ((queue)->capacity - 1)])
+
+static int ring_enqueue(queue_t queue, void *data)
+{
+	// full: double the capacity, with the items in order from index 0
+	if (queue->size == queue->capacity) {
+		void **ring = malloc(2 * queue->capacity * sizeof(void *));
+		if (ring == NULL) return -1;
+
+		int to_end = queue->capacity - queue->head;
+		memcpy(ring, queue->ring + queue->head, to_end * sizeof(void *));
+		memcpy(ring + to_end, queue->ring, queue->head * sizeof(void *));
+		free(queue->ring);
+		queue->ring = ring;
+		queue->head = 0;
+		queue->capacity *= 2;
+	}
+
+	RING_ITEM(queue, queue->size) = data;
+	queue->size++;
+	return 0;
+}
+
+static int ring_dequeue(queue_t queue, void **data)
+{
+	*data = queue->ring[queue->head];
+	queue->head = (queue->head + 1) & (queue->capacity - 1);
+	queue->size--;
+	return 0;
+}
+
+static int ring_delete(queue_t queue, void *data)
+{
+	for (int i = 0; i < queue->size; i++) {
+		if (RING_ITEM(queue, i) != data)
+			continue;
+
+		// close the gap, keeping the order of the items
+		for (int j = i + 1; j < queue->size; j++)
+			RING_ITEM(queue, j - 1) = RING_ITEM(queue, j);
+		queue->size--;
+		return 0;
+	}
+	return -1;
+}
+
+static int ring_iterate(queue_t queue, queue_func_t func)
+{
+	int i = 0;
+	while (i < queue->size)
+	{
+		void *data = RING_ITEM(queue, i);
+		func(data);
+
+		// if the item (or one before it) got deleted by func, the
+		// next item moved to its position
+		if (i < queue->size && RING_ITEM(queue, i) == data)
+			i++;
+	}
+	return 0;
+}
+
 void queue_iterate_db(queue_t queue)
 {
 	if(queue == NULL) return;
@@ -15,14 +15,33 @@ typedef struct queue* queue_t;
 /*
  * queue_create - Allocate an empty queue
  *
+ * The items are kept in a linked list, with one allocation per item.
+ *
  * Return: Pointer to empty queue, or NULL in case of failure
  */
 queue_t queue_create(void);
 
+/*
+ * queue_create_ring - Allocate an empty queue backed by a ring buffer
+ * @capacity: Number of items to make room for initially, or 0 for a default
+ *
+ * The items are kept in a contiguous array, whose capacity is a power of two
+ * and doubles whenever it is full: enqueueing is amortized O(1) and never
+ * allocates memory once the queue has grown to its largest size. Deleting
+ * items moves the ones after them. The queue is used with the same functions
+ * as the ones from queue_create().
+ *
+ * Return: Pointer to empty queue, or NULL in case of failure
+ */
+queue_t queue_create_ring(int capacity);
+
 /*
  * queue_destroy - Deallocate a queue
  * @queue: Queue to deallocate
  *
+ * Items still in @queue are not deallocated: they belong to the caller, who
+ * must deallocate them (if needed) beforehand, for example by dequeueing them.
+ *
  * Return: 0 if @queue was successfully destroyed, or -1 in case of failure
  */
 int queue_destroy(queue_t queue);
@@ -0,0 +1,274 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#define _UTHREAD_PRIVATE
+#include "preempt.h"
+#include "queue.h"
+#include "sem.h"
+#include "uthread.h"
+
+/*
+ * Every object keeps its blocked uthreads in a FIFO queue. A resource (or a
+ * mutex) released while uthreads are waiting is handed over to the oldest one
+ * before it is unblocked, so that it cannot be taken in between by a uthread
+ * which never waited. The queues are ring buffers, which stop allocating
+ * memory once grown to the largest number of waiters. Every object has a
+ * lock, as the uthreads using it may run on several workers, and a uthread
+ * going to wait only releases it once switched out (see
+ * uthread_block_locked()). Preemption is disabled while the lock is held.
+ */
+struct semaphore {
+	pthread_mutex_t lock;
+	size_t          count;
+	queue_t         waiters;
+};
+
+struct mutex {
+	pthread_mutex_t    lock;
+	struct uthread_tcb *owner;
+	queue_t            waiters;
+};
+
+struct cond {
+	pthread_mutex_t lock;
+	queue_t         waiters;
+};
+
+
+sem_t sem_create(size_t count)
+{
+	struct semaphore *sem = malloc(sizeof(struct semaphore));
+	if (sem == NULL)
+		return NULL;
+
+	pthread_mutex_init(&sem->lock, NULL);
+	sem->count = count;
+	sem->waiters = queue_create_ring(0);
+	if (sem->waiters == NULL) {
+		free(sem);
+		return NULL;
+	}
+	return sem;
+}
+
+
+int sem_destroy(sem_t sem)
+{
+	if (sem == NULL || queue_length(sem->waiters) > 0)
+		return -1;
+
+	queue_destroy(sem->waiters);
+	pthread_mutex_destroy(&sem->lock);
+	free(sem);
+	return 0;
+}
+
+
+int sem_down(sem_t sem)
+{
+	PREEMPT_DISABLE_SCOPE();
+
+	if (sem == NULL)
+		return -1;
+
+	pthread_mutex_lock(&sem->lock);
+	if (sem->count > 0) {
+		sem->count--;
+		pthread_mutex_unlock(&sem->lock);
+		return 0;
+	}
+
+	// the resource is handed over by sem_up()
+	if (queue_enqueue(sem->waiters, uthread_current()) == -1) {
+		pthread_mutex_unlock(&sem->lock);
+		return -1;
+	}
+	uthread_block_locked(&sem->lock);
+	return 0;
+}
+
+
+int sem_up(sem_t sem)
+{
+	PREEMPT_DISABLE_SCOPE();
+
+	if (sem == NULL)
+		return -1;
+
+	struct uthread_tcb *waiter;
+	pthread_mutex_lock(&sem->lock);
+	int ret = queue_dequeue(sem->waiters, (void**)&waiter);
+	if (ret == -1)
+		sem->count++;
+	pthread_mutex_unlock(&sem->lock);
+
+	if (ret == 0)
+		uthread_unblock(waiter);
+	return 0;
+}
+
+
+mutex_t mutex_create(void)
+{
+	struct mutex *mutex = malloc(sizeof(struct mutex));
+	if (mutex == NULL)
+		return NULL;
+
+	pthread_mutex_init(&mutex->lock, NULL);
+	mutex->owner = NULL;
+	mutex->waiters = queue_create_ring(0);
+	if (mutex->waiters == NULL) {
+		free(mutex);
+		return NULL;
+	}
+	return mutex;
+}
+
+
+int mutex_destroy(mutex_t mutex)
+{
+	if (mutex == NULL || mutex->owner != NULL)
+		return -1;
+
+	queue_destroy(mutex->waiters);
+	pthread_mutex_destroy(&mutex->lock);
+	free(mutex);
+	return 0;
+}
+
+
+int mutex_lock(mutex_t mutex)
+{
+	PREEMPT_DISABLE_SCOPE();
+
+	if (mutex == NULL)
+		return -1;
+
+	pthread_mutex_lock(&mutex->lock);
+	if (mutex->owner == uthread_current()) {
+		pthread_mutex_unlock(&mutex->lock);
+		return -1;
+	}
+	if (mutex->owner == NULL) {
+		mutex->owner = uthread_current();
+		pthread_mutex_unlock(&mutex->lock);
+		return 0;
+	}
+
+	// the mutex is handed over by mutex_unlock()
+	if (queue_enqueue(mutex->waiters, uthread_current()) == -1) {
+		pthread_mutex_unlock(&mutex->lock);
+		return -1;
+	}
+	uthread_block_locked(&mutex->lock);
+	return 0;
+}
+
+
+int mutex_unlock(mutex_t mutex)
+{
+	PREEMPT_DISABLE_SCOPE();
+
+	if (mutex == NULL)
+		return -1;
+
+	struct uthread_tcb *waiter;
+	pthread_mutex_lock(&mutex->lock);
+	if (mutex->owner != uthread_current()) {
+		pthread_mutex_unlock(&mutex->lock);
+		return -1;
+	}
+	int ret = queue_dequeue(mutex->waiters, (void**)&waiter);
+	mutex->owner = ret == 0 ? waiter : NULL;
+	pthread_mutex_unlock(&mutex->lock);
+
+	if (ret == 0)
+		uthread_unblock(waiter);
+	return 0;
+}
+
+
+cond_t cond_create(void)
+{
+	struct cond *cond = malloc(sizeof(struct cond));
+	if (cond == NULL)
+		return NULL;
+
+	pthread_mutex_init(&cond->lock, NULL);
+	cond->waiters = queue_create_ring(0);
+	if (cond->waiters == NULL) {
+		free(cond);
+		return NULL;
+	}
+	return cond;
+}
+
+
+int cond_destroy(cond_t cond)
+{
+	if (cond == NULL || queue_length(cond->waiters) > 0)
+		return -1;
+
+	queue_destroy(cond->waiters);
+	pthread_mutex_destroy(&cond->lock);
+	free(cond);
+	return 0;
+}
+
+
+int cond_wait(cond_t cond, mutex_t mutex)
+{
+	PREEMPT_DISABLE_SCOPE();
+
+	if (cond == NULL || mutex == NULL)
+		return -1;
+
+	// waiting starts before the mutex gets unlocked
+	pthread_mutex_lock(&cond->lock);
+	if (queue_enqueue(cond->waiters, uthread_current()) == -1) {
+		pthread_mutex_unlock(&cond->lock);
+		return -1;
+	}
+	if (mutex_unlock(mutex) == -1) {
+		queue_delete(cond->waiters, uthread_current());
+		pthread_mutex_unlock(&cond->lock);
+		return -1;
+	}
+	uthread_block_locked(&cond->lock);
+	return mutex_lock(mutex);
+}
+
+
+int cond_signal(cond_t cond)
+{
+	PREEMPT_DISABLE_SCOPE();
+
+	if (cond == NULL)
+		return -1;
+
+	struct uthread_tcb *waiter;
+	pthread_mutex_lock(&cond->lock);
+	int ret = queue_dequeue(cond->waiters, (void**)&waiter);
+	pthread_mutex_unlock(&cond->lock);
+
+	if (ret == 0)
+		uthread_unblock(waiter);
+	return 0;
+}
+
+
+int cond_broadcast(cond_t cond)
+{
+	PREEMPT_DISABLE_SCOPE();
+
+	if (cond == NULL)
+		return -1;
+
+	struct uthread_tcb *waiter;
+	pthread_mutex_lock(&cond->lock);
+	while (queue_dequeue(cond->waiters, (void**)&waiter) == 0)
+		uthread_unblock(waiter);
+	pthread_mutex_unlock(&cond->lock);
+	return 0;
+}
@@ -0,0 +1,154 @@
+#ifndef _SEM_H
+#define _SEM_H
+
+#include <stddef.h>
+
+/*
+ * Synchronization between uthreads
+ *
+ * Waiting uthreads are blocked, never spinning, and are woken up in the order
+ * they started waiting. All the objects below are deallocated by their
+ * destroy function, which fails while uthreads are still waiting on them.
+ */
+
+/*
+ * sem_t - Semaphore type
+ */
+typedef struct semaphore *sem_t;
+
+/*
+ * sem_create - Create semaphore
+ * @count: Semaphore count
+ *
+ * Return: Pointer to initialized semaphore, or NULL in case of failure
+ */
+sem_t sem_create(size_t count);
+
+/*
+ * sem_destroy - Deallocate a semaphore
+ * @sem: Semaphore to deallocate
+ *
+ * Return: -1 if @sem is NULL or if other threads are still being blocked on
+ * it, 0 otherwise
+ */
+int sem_destroy(sem_t sem);
+
+/*
+ * sem_down - Take a resource from semaphore
+ * @sem: Semaphore to take resource from
+ *
+ * Take a resource from semaphore @sem, blocking the calling thread while
+ * there is none.
+ *
+ * Return: -1 if @sem is NULL or if the calling thread cannot wait, 0
+ * otherwise
+ */
+int sem_down(sem_t sem);
+
+/*
+ * sem_up - Release a resource to semaphore
+ * @sem: Semaphore to release resource to
+ *
+ * Release a resource to semaphore @sem. The oldest thread waiting on it, if
+ * any, gets the resource and is unblocked.
+ *
+ * Return: -1 if @sem is NULL, 0 otherwise
+ */
+int sem_up(sem_t sem);
+
+/*
+ * mutex_t - Mutex type
+ */
+typedef struct mutex *mutex_t;
+
+/*
+ * mutex_create - Create an unlocked mutex
+ *
+ * Return: Pointer to initialized mutex, or NULL in case of failure
+ */
+mutex_t mutex_create(void);
+
+/*
+ * mutex_destroy - Deallocate a mutex
+ * @mutex: Mutex to deallocate
+ *
+ * Return: -1 if @mutex is NULL or locked, 0 otherwise
+ */
+int mutex_destroy(mutex_t mutex);
+
+/*
+ * mutex_lock - Lock a mutex
+ * @mutex: Mutex to lock
+ *
+ * The calling thread is blocked while @mutex is locked by another thread.
+ *
+ * Return: -1 if @mutex is NULL, already locked by the calling thread, or if
+ * the calling thread cannot wait, 0 otherwise
+ */
+int mutex_lock(mutex_t mutex);
+
+/*
+ * mutex_unlock - Unlock a mutex
+ * @mutex: Mutex to unlock
+ *
+ * The oldest thread waiting for @mutex, if any, gets it locked and is
+ * unblocked.
+ *
+ * Return: -1 if @mutex is NULL or not locked by the calling thread, 0
+ * otherwise
+ */
+int mutex_unlock(mutex_t mutex);
+
+/*
+ * cond_t - Condition variable type
+ */
+typedef struct cond *cond_t;
+
+/*
+ * cond_create - Create a condition variable
+ *
+ * Return: Pointer to initialized condition variable, or NULL in case of
+ * failure
+ */
+cond_t cond_create(void);
+
+/*
+ * cond_destroy - Deallocate a condition variable
+ * @cond: Condition variable to deallocate
+ *
+ * Return: -1 if @cond is NULL or if other threads are still waiting on it, 0
+ * otherwise
+ */
+int cond_destroy(cond_t cond);
+
+/*
+ * cond_wait - Wait on a condition variable
+ * @cond: Condition variable to wait on
+ * @mutex: Mutex locked by the calling thread
+ *
+ * Unlock @mutex and block the calling thread until @cond is signaled, then
+ * lock @mutex again before returning. Unlocking and starting to wait happen
+ * at once, so that no signal gets lost in between.
+ *
+ * Return: -1 if @cond or @mutex is NULL, if @mutex is not locked by the
+ * calling thread, or if the calling thread cannot wait, 0 otherwise
+ */
+int cond_wait(cond_t cond, mutex_t mutex);
+
+/*
+ * cond_signal - Wake up the oldest thread waiting on a condition variable
+ * @cond: Condition variable to signal
+ *
+ * Return: -1 if @cond is NULL, 0 otherwise
+ */
+int cond_signal(cond_t cond);
+
+/*
+ * cond_broadcast - Wake up all the threads waiting on a condition variable
+ * @cond: Condition variable to signal
+ *
+ * Return: -1 if @cond is NULL, 0 otherwise
+ */
+int cond_broadcast(cond_t cond);
+
+#endif /* _SEM_H */
@@ -1,22 +1,45 @@
 #include <assert.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
+#include <time.h>
 
 #define _UTHREAD_PRIVATE
 #include "context.h"
-#include "queue.h"
+#include "preempt.h"
 #include "uthread.h"
 
-// global access array (all threads)
-// note: semaphore_queue always contains blocked ppl
-queue_t queue, semaphore_queue;		
-struct uthread_tcb* curThread, *cur_sem_thread;
+typedef enum { false, true } bool;
+
+// Largest number of exited TCBs (with their context and stack) kept by a
+// worker for its next uthread_create()
+#define WORKER_TCB_CACHE 64
+
+// Number of TCBs allocated at once
+#define TCB_SLAB_SIZE 64
+
+// Number of buckets of the TID hash table
+#define TID_HASH_SIZE 1024
+
+// A yielding thread lets the lower classes run once every that many yields
+#define SCHED_AGING_YIELDS 8
+
 int thread_id = 0;
-sigset_t SavedMask;					
+sigset_t SavedMask;
+
+// time slice of preemption in microseconds, 0 when cooperative
+static unsigned int preempt_slice_us = 0;
+
+// number of worker pthreads running the threads
+static int num_workers_config = 1;
+
+// thread-local storage slots allocated by uthread_tls_alloc() (atomic)
+static int num_tls_slots = 0;
 
 
 typedef enum
@@ -29,176 +52,780 @@ typedef enum
 
 
 struct uthread_tcb {
-	uthread_ctx_t   *context;
+	uthread_ctx_t   context;
 	void* 			stack;
+	size_t          stack_size;
+	size_t          stack_guard;	// as mapped, whatever the current setting
 	uthread_state_t state;
 	int 			id;
+	int 			preempt_depth;	// saved across context switches
+	uthread_func_t  func;
+	void            *arg;
+	struct uthread_tcb *next_free;	// in the TCB cache of a worker, or free
+	int             sched_class;
+	uint64_t        deadline;		// in ns of CLOCK_MONOTONIC, 0 if none
+	struct uthread_tcb *next_ready;	// in a run queue
+	void            *tls[UTHREAD_TLS_SLOTS];
+
+	// under tid_lock
+	struct uthread_tcb *next_tid;	// in the TID hash table
+	struct uthread_tcb *joiner;		// thread blocked in uthread_join()
+	void            *retval;
+	bool            is_detached;
+	bool            is_zombie;		// exited and switched out, not joined
+};
+
+
+/*
+ * TCBs:
+ * The TCBs, with their context, are allocated by slabs of TCB_SLAB_SIZE and
+ * are only freed once uthread_start() returns. Together with the TCB cache of
+ * every worker and the run queues linking the TCBs themselves, scheduling
+ * threads never allocates memory.
+ */
+struct tcb_slab {
+	struct tcb_slab    *next;
+	struct uthread_tcb tcbs[TCB_SLAB_SIZE];
 };
 
+static pthread_mutex_t    slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tcb_slab    *slabs;
+static struct uthread_tcb *free_tcbs;
+
+
+/*
+ * Joining:
+ * The threads which can still be joined or detached are found by TID in a
+ * hash table. A thread removes itself from it when it exits detached,
+ * otherwise it stays there as a zombie, whose stack is released, until the
+ * thread joining it (if any, already blocked, or later) takes its return
+ * value and deallocates it. Zombies are only marked once switched out, so
+ * that their TCB is never deallocated while still in use.
+ */
+static pthread_mutex_t    tid_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct uthread_tcb *tid_hash[TID_HASH_SIZE];
+
+
+/*
+ * Scheduling classes:
+ * Every worker has a run queue per class, and takes the next thread from the
+ * highest class with a ready thread. In a run queue, the threads with a
+ * deadline wait in a list sorted by deadline, and run before the threads
+ * without one, which wait in FIFO order. A running thread is only preempted,
+ * or yields, in favor of a thread of its own class or a higher one, except
+ * on every SCHED_AGING_YIELDS-th yield of a worker: the lower classes then
+ * come first, each in turn, so that they are never starved.
+ */
+struct run_queue {
+	struct uthread_tcb *edf;      // earliest deadline first
+	struct uthread_tcb *fifo_head;
+	struct uthread_tcb *fifo_tail;
+};
+
+
+/*
+ * Workers:
+ * The threads run on one or more worker pthreads, the first one being the
+ * pthread which called uthread_start(). Every worker has its own run queue,
+ * takes its next thread from it, and steals the oldest ready thread of
+ * another worker when its own is empty. A worker without any thread to run
+ * sleeps in its scheduler context (the pthread's own stack) until a thread
+ * gets ready, and the workers stop once all of them are asleep.
+ *
+ * A thread switching out is only made ready, or its lock released if it
+ * blocks, by the thread or scheduler which runs next on the same worker,
+ * once the switch is complete: no other worker can resume it before its
+ * context is saved.
+ */
+struct worker {
+	pthread_t          pthread;
+	int                index;
+	pthread_mutex_t    lock;          // run queues
+	struct run_queue   run_queues[UTHREAD_NUM_CLASSES];
+	unsigned int       num_yields;
+	struct uthread_tcb *current;
+	struct uthread_tcb *scheduler;    // context of the worker's own loop
+	struct uthread_tcb *prev;         // thread which just switched out
+	pthread_mutex_t    *prev_lock;    // released once prev is switched out
+	struct uthread_tcb *tcb_cache;
+	int                num_cached;
+};
+
+static struct worker   *workers;
+static int             num_workers;
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  sched_cond = PTHREAD_COND_INITIALIZER;
+static int             num_idle;      // workers asleep (atomic)
+static bool            is_done;       // under sched_lock
+static int             num_ready;     // threads in the run queues (atomic)
+
+static __thread struct worker *self;
+
+// private API
+static struct uthread_tcb *alloc_tcb(void);
+static void free_tcb(struct uthread_tcb *uthread);
+static struct uthread_tcb **find_tid(uthread_t tid);
+static struct uthread_tcb *find_work(struct worker *w, int first_class, int max_class);
+static struct uthread_tcb *pop_ready(struct run_queue *rq);
+static void push_ready(struct worker *w, struct uthread_tcb *uthread);
+static void finish_switch(struct worker *w);
+static void switch_to(struct worker *w, struct uthread_tcb *cur, struct uthread_tcb *next);
+static void uthread_trampoline(void *arg);
+static void *worker_main(void *arg);
+static void worker_loop(struct worker *w);
+
 
 struct uthread_tcb *uthread_current(void)
 {
-	return curThread;
+	return self ? self->current : NULL;
 }
 
 
 void uthread_yield(void)
 {
-	// save current state
-	struct uthread_tcb* cur_save = uthread_current();
+	preempt_disable();
+
+	struct worker *w = self;
+	struct uthread_tcb *cur_save = w->current;
+
+	// the next ready thread of the same class or a higher one runs next,
+	// the current one keeps running if there is none and it is still ready.
+	// Aging yields start from a lower class instead, each in turn
+	int first_class = 0;
+	int max_class = cur_save->sched_class;
+	if (++w->num_yields % SCHED_AGING_YIELDS == 0) {
+		first_class = 1 + w->num_yields / SCHED_AGING_YIELDS % (UTHREAD_NUM_CLASSES - 1);
+		max_class = UTHREAD_NUM_CLASSES - 1;
+	}
+	struct uthread_tcb *front = find_work(w, first_class, max_class);
+	if (front == NULL) {
+		if (cur_save->state == RUNNING) {
+			preempt_enable();
+			return;
+		}
+		front = w->scheduler;
+	}
 
 	// if the current state is running, then it hasnt
-	// finished its execution, so its we reset its 
+	// finished its execution, so its we reset its
 	// state to ready.
 	if (cur_save->state == RUNNING)
 		cur_save->state = READY;
 
-	// save oldest element in the queue
-	struct uthread_tcb *front;
-
-
-	if (queue_dequeue(queue, (void**) &front) == -1) {
-		fprintf(stderr, "Failure to dequeue from queue.\n");
-		return;
-	} //printf("id: %d\n", front->id);
+	switch_to(w, cur_save, front);
 
+	preempt_restore(cur_save->preempt_depth);
+	preempt_enable();
+}
 
-	// the oldest element in the queue is now ready 
-	// to be next thread in context execution but it
-	// had to have come from a ready state since it was queued
-	assert(front->state == READY);
-
-	// and is now the next context execution to run 
-	front->state = RUNNING;
-
-	// current thread becomes the new thread from queue
-	curThread = front;
 
-	// enqueue the old one to the back of the queue
-	if (cur_save->state == READY)
-	{		
-		queue_enqueue(queue, cur_save);
-		
-	}
-	
-	// switch context from the previous one 
-	// to the new one from the dequeue
-	uthread_ctx_switch(cur_save->context, front->context);
-	if (cur_save->state == TERMINATED) {
-		free(cur_save->context);
-		free(cur_save->stack);
-		free(cur_save);
-		cur_save = NULL;
-	}
+uthread_t uthread_create(uthread_func_t func, void *arg)
+{
+	return uthread_create_stack(func, arg, 0);
 }
 
 
-int uthread_create(uthread_func_t func, void *arg)
+uthread_t uthread_create_stack(uthread_func_t func, void *arg,
+			       size_t stack_size)
 {
-	// initialize thread
-	struct uthread_tcb* thread = 
-				(struct uthread_tcb*)malloc(sizeof(struct uthread_tcb));
-	if (thread == NULL) {
-		fprintf(stderr, "Failure to allocate memory to thread tcb.\n");
-		return -1;
+	PREEMPT_DISABLE_SCOPE();
+
+	struct worker *w = self;
+	struct uthread_tcb* thread;
+	size_t size = uthread_ctx_stack_size(stack_size);
+
+	// reuse an exited thread of this worker, with its context, and its
+	// stack if the size is right
+	if (w->tcb_cache) {
+		thread = w->tcb_cache;
+		w->tcb_cache = thread->next_free;
+		w->num_cached--;
+		if (thread->stack_size != size ||
+		    thread->stack_guard != uthread_ctx_stack_guard()) {
+			uthread_ctx_destroy_stack(thread->stack, thread->stack_size,
+						  thread->stack_guard);
+			thread->stack = uthread_ctx_alloc_stack(&size, &thread->stack_guard);
+			thread->stack_size = size;
+		}
+	} else {
+		// initialize thread
+		thread = alloc_tcb();
+		if (thread == NULL) {
+			fprintf(stderr, "Failure to allocate memory to thread tcb.\n");
+			return -1;
+		}
+		thread->stack   = uthread_ctx_alloc_stack(&size, &thread->stack_guard);
+		thread->stack_size = size;
 	}
-
-	// initialize thread properties
-	thread->context = (uthread_ctx_t *)malloc(sizeof(uthread_ctx_t));
-	if (thread->context == NULL) {
-		fprintf(stderr, "Failure to allocate memory to context.\n");
+	if (thread->stack == NULL) {
+		fprintf(stderr, "Failure to allocate memory to stack.\n");
+		free_tcb(thread);
 		return -1;
 	}
 	thread->state   = READY;
-	thread->id 		= thread_id++;
-	thread->stack   = uthread_ctx_alloc_stack();
+	thread->preempt_depth = 0;
+	thread->id 		= __atomic_fetch_add(&thread_id, 1, __ATOMIC_RELAXED);
+	thread->func    = func;
+	thread->arg     = arg;
+	thread->sched_class = w->current->sched_class;
+	thread->deadline    = 0;
+	memset(thread->tls, 0, sizeof(thread->tls));
+	thread->joiner      = NULL;
+	thread->retval      = NULL;
+	thread->is_detached = false;
+	thread->is_zombie   = false;
 
 	// initialize thread execution context
-	if (uthread_ctx_init(thread->context, thread->stack, func, arg) == -1) {
+	if (uthread_ctx_init(&thread->context, thread->stack, thread->stack_size,
+			     uthread_trampoline, thread) == -1) {
 		fprintf(stderr, "Failure to initialize execution context");
+		uthread_ctx_destroy_stack(thread->stack, thread->stack_size,
+					  thread->stack_guard);
+		free_tcb(thread);
 		return -1;
 	}
 
-	// enqueue thread
-	queue_enqueue(queue, thread);
+	// make the thread joinable, then enqueue it
+	uthread_t tid = thread->id;
+	pthread_mutex_lock(&tid_lock);
+	struct uthread_tcb **bucket = &tid_hash[tid % TID_HASH_SIZE];
+	thread->next_tid = *bucket;
+	*bucket = thread;
+	pthread_mutex_unlock(&tid_lock);
+	push_ready(w, thread);
 
-	return 0;
+	return tid;
 }
 
 
 void uthread_exit(void)
 {
-	struct uthread_tcb *cur_running = uthread_current();
+	uthread_exit_retval(NULL);
+}
+
 
-	free(cur_running->context);
-	free(cur_running->stack);
+void uthread_exit_retval(void *retval)
+{
+	preempt_disable();
+	struct worker *w = self;
+	struct uthread_tcb *cur_running = w->current;
+
+	// the context and stack get recycled, or the thread becomes a zombie,
+	// once switched out
+	cur_running->retval = retval;
 	cur_running->state = TERMINATED;
 
 	// goto next thread in queue
-	uthread_yield();
+	struct uthread_tcb *front = find_work(w, 0, UTHREAD_NUM_CLASSES - 1);
+	switch_to(w, cur_running, front ? front : w->scheduler);
 }
 
 
 void uthread_block(void)
 {
-	curThread->state = BLOCKED;
-	uthread_yield();
+	uthread_block_locked(NULL);
+}
+
+
+void uthread_block_locked(pthread_mutex_t *lock)
+{
+	preempt_disable();
+
+	struct worker *w = self;
+	struct uthread_tcb *cur_save = w->current;
+	cur_save->state = BLOCKED;
+	w->prev_lock = lock;
+
+	struct uthread_tcb *front = find_work(w, 0, UTHREAD_NUM_CLASSES - 1);
+	switch_to(w, cur_save, front ? front : w->scheduler);
+
+	preempt_restore(cur_save->preempt_depth);
+	preempt_enable();
 }
 
 
 void uthread_unblock(struct uthread_tcb *uthread)
 {
+	PREEMPT_DISABLE_SCOPE();
+
 	// must come from a blocked stated
 	assert(uthread->state == BLOCKED);
 
-	// find the thread in the queue and change state
+	// enqueue back into the queue of the unblocking worker
 	uthread->state = READY;
+	push_ready(self, uthread);
+}
+
+
+uthread_t uthread_self(void)
+{
+	return uthread_current()->id;
+}
 
 
+int uthread_join(uthread_t tid, void **retval)
+{
+	PREEMPT_DISABLE_SCOPE();
 
-	// enqueue back into the queue 
-	queue_enqueue(queue, uthread);
-	
+	struct uthread_tcb *cur = uthread_current();
+	struct uthread_tcb **link, *thread;
+
+	pthread_mutex_lock(&tid_lock);
+	link = find_tid(tid);
+	thread = link ? *link : NULL;
+	if (thread == NULL || thread == cur || thread->is_detached ||
+	    thread->joiner) {
+		pthread_mutex_unlock(&tid_lock);
+		return -1;
+	}
+
+	// woken up by the worker which switches the thread out on exit
+	if (!thread->is_zombie) {
+		thread->joiner = cur;
+		uthread_block_locked(&tid_lock);
+		pthread_mutex_lock(&tid_lock);
+		link = find_tid(tid);
+	}
+	*link = thread->next_tid;
+	pthread_mutex_unlock(&tid_lock);
+
+	if (retval)
+		*retval = thread->retval;
+	free_tcb(thread);
+	return 0;
 }
 
 
-void uthread_start(uthread_func_t start, void *arg)
+int uthread_detach(uthread_t tid)
 {
+	PREEMPT_DISABLE_SCOPE();
 
-	// initialize queue
-	queue = queue_create();
-	
-	if (queue == NULL) {
-		fprintf(stderr, "Failure to allocate memory to queue.\n");
-		return;
+	struct uthread_tcb **link, *thread;
+
+	pthread_mutex_lock(&tid_lock);
+	link = find_tid(tid);
+	thread = link ? *link : NULL;
+	if (thread == NULL || thread->is_detached || thread->joiner) {
+		pthread_mutex_unlock(&tid_lock);
+		return -1;
+	}
+	if (!thread->is_zombie) {
+		thread->is_detached = true;
+		pthread_mutex_unlock(&tid_lock);
+		return 0;
 	}
+	*link = thread->next_tid;
+	pthread_mutex_unlock(&tid_lock);
 
-	// initialize main idle thread and current thread
-	struct uthread_tcb* idle_thread = 
-				(struct uthread_tcb*)malloc(sizeof(struct uthread_tcb));
-	if (idle_thread == NULL) {
-		fprintf(stderr, "Failure to allocate memory to thread tcb.\n");
-		return;
+	free_tcb(thread);
+	return 0;
+}
+
+
+int uthread_tls_alloc(void)
+{
+	int slot = __atomic_fetch_add(&num_tls_slots, 1, __ATOMIC_RELAXED);
+	if (slot >= UTHREAD_TLS_SLOTS) {
+		__atomic_fetch_sub(&num_tls_slots, 1, __ATOMIC_RELAXED);
+		return -1;
 	}
+	return slot;
+}
+
 
-	// initialize thread properties
-	idle_thread->context = (uthread_ctx_t *)malloc(sizeof(uthread_ctx_t));
-	if (idle_thread->context == NULL) {
-		fprintf(stderr, "Failure to allocate memory to context.\n");
+void *uthread_tls_get(int slot)
+{
+	if (slot < 0 || slot >= UTHREAD_TLS_SLOTS)
+		return NULL;
+	return uthread_current()->tls[slot];
+}
+
+
+int uthread_tls_set(int slot, void *value)
+{
+	if (slot < 0 || slot >= UTHREAD_TLS_SLOTS)
+		return -1;
+	uthread_current()->tls[slot] = value;
+	return 0;
+}
+
+
+void uthread_start(uthread_func_t start, void *arg)
+{
+	num_workers = num_workers_config;
+	workers = calloc(num_workers, sizeof(struct worker));
+	if (workers == NULL) {
+		fprintf(stderr, "Failure to allocate memory to workers.\n");
 		return;
 	}
-	idle_thread->state   = RUNNING;
-	idle_thread->id      = thread_id++;
 
-	// set current thread to
-	curThread = idle_thread;
+	for (int i = 0; i < num_workers; i++) {
+		struct worker *w = &workers[i];
+		w->index = i;
+		pthread_mutex_init(&w->lock, NULL);
+
+		// initialize the scheduler context of the worker
+		w->scheduler = (struct uthread_tcb*)calloc(1, sizeof(struct uthread_tcb));
+		if (w->scheduler == NULL) {
+			fprintf(stderr, "Failure to allocate memory to worker.\n");
+			return;
+		}
+		w->scheduler->state = RUNNING;
+		w->scheduler->sched_class = UTHREAD_CLASS_BATCH;
+		w->scheduler->id    = __atomic_fetch_add(&thread_id, 1, __ATOMIC_RELAXED);
+	}
+	num_idle = 0;
+	is_done = false;
 
+	// the calling pthread is the first worker
+	self = &workers[0];
+	self->current = self->scheduler;
 	if(uthread_create(start, arg) == -1) {
 		fprintf(stderr, "Error: fail to create idle_thread.\n");
 		return ;
 	}
 
-	// set idle 
-	while(queue_length(queue) != 0) 
-		uthread_yield();
-}
\ No newline at end of file
+	for (int i = 1; i < num_workers; i++) {
+		if (pthread_create(&workers[i].pthread, NULL, worker_main, &workers[i])) {
+			fprintf(stderr, "Failure to create worker.\n");
+			exit(1);
+		}
+	}
+
+	worker_loop(self);
+
+	for (int i = 1; i < num_workers; i++)
+		pthread_join(workers[i].pthread, NULL);
+
+	// threads still blocked are abandoned, exited ones are deallocated
+	for (int i = 0; i < num_workers; i++) {
+		struct worker *w = &workers[i];
+		while (w->tcb_cache) {
+			struct uthread_tcb *thread = w->tcb_cache;
+			w->tcb_cache = thread->next_free;
+			uthread_ctx_destroy_stack(thread->stack, thread->stack_size,
+						  thread->stack_guard);
+		}
+		pthread_mutex_destroy(&w->lock);
+		free(w->scheduler);
+	}
+	while (slabs) {
+		struct tcb_slab *slab = slabs;
+		slabs = slab->next;
+		free(slab);
+	}
+	free_tcbs = NULL;
+	memset(tid_hash, 0, sizeof(tid_hash));
+	free(workers);
+	workers = NULL;
+	self = NULL;
+}
+
+
+void uthread_preempt_config(unsigned int slice_us)
+{
+	preempt_slice_us = slice_us;
+}
+
+
+void uthread_workers_config(int nworkers)
+{
+	if (nworkers > 0)
+		num_workers_config = nworkers;
+}
+
+
+int uthread_set_class(int sched_class)
+{
+	if (sched_class < 0 || sched_class >= UTHREAD_NUM_CLASSES)
+		return -1;
+
+	uthread_current()->sched_class = sched_class;
+	return 0;
+}
+
+
+void uthread_set_deadline(unsigned long deadline_us)
+{
+	struct uthread_tcb *cur = uthread_current();
+	struct timespec now;
+
+	if (deadline_us == 0) {
+		cur->deadline = 0;
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	cur->deadline = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec +
+		(uint64_t)deadline_us * 1000;
+}
+
+
+// helper: create
+// Take a TCB from the free ones, allocating a new slab if there is none
+static struct uthread_tcb *alloc_tcb(void)
+{
+	struct uthread_tcb *thread;
+
+	pthread_mutex_lock(&slab_lock);
+	if (free_tcbs == NULL) {
+		struct tcb_slab *slab = malloc(sizeof(struct tcb_slab));
+		if (slab == NULL) {
+			pthread_mutex_unlock(&slab_lock);
+			return NULL;
+		}
+		slab->next = slabs;
+		slabs = slab;
+		for (int i = TCB_SLAB_SIZE - 1; i >= 0; i--) {
+			slab->tcbs[i].next_free = free_tcbs;
+			free_tcbs = &slab->tcbs[i];
+		}
+	}
+	thread = free_tcbs;
+	free_tcbs = thread->next_free;
+	pthread_mutex_unlock(&slab_lock);
+	return thread;
+}
+
+
+// helper: create
+// Give a TCB, whose stack is deallocated, back to the free ones
+static void free_tcb(struct uthread_tcb *uthread)
+{
+	pthread_mutex_lock(&slab_lock);
+	uthread->next_free = free_tcbs;
+	free_tcbs = uthread;
+	pthread_mutex_unlock(&slab_lock);
+}
+
+
+// helper: join
+// Called with tid_lock held. Link to the joinable thread of TID tid in the
+// hash table, or NULL if there is none
+static struct uthread_tcb **find_tid(uthread_t tid)
+{
+	struct uthread_tcb **link;
+
+	if (tid < 0)
+		return NULL;
+	link = &tid_hash[tid % TID_HASH_SIZE];
+	while (*link && (*link)->id != tid)
+		link = &(*link)->next_tid;
+	return *link ? link : NULL;
+}
+
+
+// helper: scheduler
+// Take the next thread of the first class with a ready thread, from
+// first_class up to max_class and then from class 0, from the worker's own
+// run queues first, or steal it from the other workers in turn. NULL if no
+// such thread is ready
+static struct uthread_tcb *find_work(struct worker *w, int first_class, int max_class)
+{
+	struct uthread_tcb *thread;
+
+	if (__atomic_load_n(&num_ready, __ATOMIC_SEQ_CST) == 0)
+		return NULL;
+
+	for (int n = 0; n <= max_class; n++) {
+		int c = (first_class + n) % (max_class + 1);
+		for (int i = 0; i < num_workers; i++) {
+			struct worker *victim = &workers[(w->index + i) % num_workers];
+			pthread_mutex_lock(&victim->lock);
+			thread = pop_ready(&victim->run_queues[c]);
+			pthread_mutex_unlock(&victim->lock);
+			if (thread) {
+				__atomic_fetch_sub(&num_ready, 1, __ATOMIC_SEQ_CST);
+				return thread;
+			}
+		}
+	}
+	return NULL;
+}
+
+
+// helper: scheduler
+// Called with the worker's lock held
+static struct uthread_tcb *pop_ready(struct run_queue *rq)
+{
+	struct uthread_tcb *thread = rq->edf;
+	if (thread) {
+		rq->edf = thread->next_ready;
+		return thread;
+	}
+	thread = rq->fifo_head;
+	if (thread) {
+		rq->fifo_head = thread->next_ready;
+		if (rq->fifo_head == NULL)
+			rq->fifo_tail = NULL;
+	}
+	return thread;
+}
+
+
+// helper: scheduler
+// Queue a ready thread, and wake a sleeping worker up
+static void push_ready(struct worker *w, struct uthread_tcb *uthread)
+{
+	struct run_queue *rq = &w->run_queues[uthread->sched_class];
+
+	pthread_mutex_lock(&w->lock);
+	if (uthread->deadline) {
+		struct uthread_tcb **link = &rq->edf;
+		while (*link && (*link)->deadline <= uthread->deadline)
+			link = &(*link)->next_ready;
+		uthread->next_ready = *link;
+		*link = uthread;
+	} else {
+		uthread->next_ready = NULL;
+		if (rq->fifo_tail)
+			rq->fifo_tail->next_ready = uthread;
+		else
+			rq->fifo_head = uthread;
+		rq->fifo_tail = uthread;
+	}
+	pthread_mutex_unlock(&w->lock);
+	__atomic_fetch_add(&num_ready, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&num_idle, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&sched_lock);
+		pthread_cond_signal(&sched_cond);
+		pthread_mutex_unlock(&sched_lock);
+	}
+}
+
+
+// helper: scheduler
+// Run on a worker right after a context switch, for the thread which
+// switched out
+static void finish_switch(struct worker *w)
+{
+	struct uthread_tcb *prev = w->prev;
+	if (prev == NULL)
+		return;
+	w->prev = NULL;
+
+	switch (prev->state) {
+	case READY:
+		push_ready(w, prev);
+		break;
+	case BLOCKED:
+		if (w->prev_lock) {
+			pthread_mutex_unlock(w->prev_lock);
+			w->prev_lock = NULL;
+		}
+		break;
+	case TERMINATED:
+		pthread_mutex_lock(&tid_lock);
+		if (!prev->is_detached) {
+			// a zombie until joined, the joiner frees the TCB
+			void *stack = prev->stack;
+			size_t stack_size = prev->stack_size;
+			size_t stack_guard = prev->stack_guard;
+			struct uthread_tcb *joiner = prev->joiner;
+			prev->stack = NULL;
+			prev->is_zombie = true;
+			pthread_mutex_unlock(&tid_lock);
+
+			uthread_ctx_destroy_stack(stack, stack_size, stack_guard);
+			if (joiner)
+				uthread_unblock(joiner);
+			break;
+		}
+		*find_tid(prev->id) = prev->next_tid;
+		pthread_mutex_unlock(&tid_lock);
+
+		if (w->num_cached < WORKER_TCB_CACHE) {
+			prev->next_free = w->tcb_cache;
+			w->tcb_cache = prev;
+			w->num_cached++;
+		} else {
+			uthread_ctx_destroy_stack(prev->stack, prev->stack_size,
+						  prev->stack_guard);
+			free_tcb(prev);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+
+// helper: scheduler
+// Switch from the current thread to the next one, on this worker. Returns
+// when cur runs again, possibly on another worker
+static void switch_to(struct worker *w, struct uthread_tcb *cur, struct uthread_tcb *next)
+{
+	next->state = RUNNING;
+	w->current  = next;
+	w->prev     = cur;
+
+	cur->preempt_depth = preempt_save();
+	uthread_ctx_switch(&cur->context, &next->context);
+
+	finish_switch(self);
+}
+
+
+// helper: create
+// First function of every thread
+static void uthread_trampoline(void *arg)
+{
+	struct uthread_tcb *thread = arg;
+
+	// preemption was disabled by the thread which switched out
+	finish_switch(self);
+	preempt_restore(1);
+	preempt_enable();
+
+	thread->func(thread->arg);
+}
+
+
+// helper: start
+static void *worker_main(void *arg)
+{
+	self = arg;
+	self->current = self->scheduler;
+	worker_loop(self);
+	return NULL;
+}
+
+
+// helper: start
+// Run threads until all the workers are out of threads to run
+static void worker_loop(struct worker *w)
+{
+	// interrupt the running thread at the end of every time slice
+	if (preempt_slice_us)
+		preempt_start(preempt_slice_us);
+
+	preempt_disable();
+	while (true) {
+		struct uthread_tcb *thread = find_work(w, 0, UTHREAD_NUM_CLASSES - 1);
+		if (thread) {
+			switch_to(w, w->scheduler, thread);
+			continue;
+		}
+
+		// sleep until a thread gets ready, the last worker to fall
+		// asleep stops them all
+		pthread_mutex_lock(&sched_lock);
+		__atomic_fetch_add(&num_idle, 1, __ATOMIC_SEQ_CST);
+		while (!is_done && __atomic_load_n(&num_ready, __ATOMIC_SEQ_CST) == 0) {
+			if (num_idle == num_workers) {
+				is_done = true;
+				pthread_cond_broadcast(&sched_cond);
+				break;
+			}
+			pthread_cond_wait(&sched_cond, &sched_lock);
+		}
+		__atomic_fetch_sub(&num_idle, 1, __ATOMIC_SEQ_CST);
+		bool done = is_done;
+		pthread_mutex_unlock(&sched_lock);
+		if (done)
+			break;
+	}
+	preempt_enable();
+
+	preempt_stop();
+}
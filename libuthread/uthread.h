@@ -7,6 +7,20 @@
  * To be used by applications
  */
 
+/* Scheduling classes, from the highest priority to the lowest */
+#define UTHREAD_CLASS_INTERACTIVE 0
+#define UTHREAD_CLASS_BATCH       1
+#define UTHREAD_CLASS_BACKGROUND  2
+#define UTHREAD_NUM_CLASSES       3
+
+/* Number of thread-local storage slots of every thread */
+#define UTHREAD_TLS_SLOTS 16
+
+/*
+ * uthread_t - Thread identifier (TID) type
+ */
+typedef int uthread_t;
+
 /*
  * uthread_func_t - Thread function type
  * @arg: Argument to be passed to the thread
@@ -23,17 +37,60 @@ typedef void (*uthread_func_t)(void *arg);
  */
 void uthread_mem_config(size_t npages);
 
+/*
+ * uthread_preempt_config - Configure thread preemption
+ * @slice_us: Time slice, in microseconds, or 0 to keep threads cooperative
+ *
+ * This function should only be called by the main() function of the
+ * application, prior to calling uthread_start(). With a time slice, the
+ * running thread is forced to yield at the end of every slice, except inside
+ * the calls to the file system, which are never preempted. The threads are
+ * cooperative by default.
+ *
+ * The C library is not protected: a thread preempted inside a function
+ * taking an internal lock, such as malloc(), deadlocks any other thread
+ * calling it before the first one runs again.
+ */
+void uthread_preempt_config(unsigned int slice_us);
+
+/*
+ * uthread_stack_config - Configure thread stacks
+ * @size: Default stack size of new threads in bytes, or 0 to keep 32 KiB
+ * @guard: Whether stacks have a guard page
+ *
+ * This function should only be called by the main() function of the
+ * application, prior to calling uthread_start(). Stack pages are only
+ * committed when first used, and the stacks of exited threads are reused.
+ * With a guard page, a stack overflow faults instead of corrupting memory,
+ * but every stack then counts as two memory mappings against the limit of the
+ * kernel (vm.max_map_count): running more than about 30000 threads at once
+ * needs either a higher limit or no guard pages.
+ */
+void uthread_stack_config(size_t size, int guard);
+
+/*
+ * uthread_workers_config - Configure the number of worker pthreads
+ * @nworkers: Number of pthreads running the threads (1 by default)
+ *
+ * This function should only be called by the main() function of the
+ * application, prior to calling uthread_start(). With more than one worker,
+ * the threads run in parallel: uthread_start() starts @nworkers - 1 pthreads
+ * next to the calling one, each with its own queue of ready threads, and the
+ * workers out of threads steal the ready threads of the others.
+ */
+void uthread_workers_config(int nworkers);
+
 /*
  * uthread_start - Start the thread system
  * @start: Function of the first thread to start
  * @arg: Argument to be passed to the first thread
  *
- * This function should only be called by the main() function of the application
- * and never returns.
+ * This function should only be called by the main() function of the application.
  *
  * This function starts the thread system and becomes the "idle" thread. It
- * exits from the application when all the threads have finished and the thread
- * system is done running.
+ * returns once no thread is left to run: all the threads have finished, or the
+ * remaining ones are blocked for good and get abandoned. The thread system can
+ * then be started again, with another call to uthread_start().
  */
 void uthread_start(uthread_func_t start, void *arg);
 
@@ -42,18 +99,123 @@ void uthread_start(uthread_func_t start, void *arg);
  * @func: Function to be executed by the thread
  * @arg: Argument to be passed to the thread
  *
- * Return: 0 in case of success, or -1 in case of failure
+ * The new thread is joinable: once exited, it remains a zombie, without its
+ * stack, until joined with uthread_join() or detached with uthread_detach().
+ *
+ * Return: TID of the new thread, or -1 in case of failure
+ */
+uthread_t uthread_create(uthread_func_t func, void *arg);
+
+/*
+ * uthread_create_stack - Create a new thread with a given stack size
+ * @func: Function to be executed by the thread
+ * @arg: Argument to be passed to the thread
+ * @stack_size: Stack size in bytes (rounded up to whole pages), or 0 for the
+ * default size
+ *
+ * Return: TID of the new thread, or -1 in case of failure
  */
-int uthread_create(uthread_func_t func, void *arg);
+uthread_t uthread_create_stack(uthread_func_t func, void *arg,
+			       size_t stack_size);
 
 /*
  * uthread_exit - Exit from currently running thread
  *
  * This function is to be called from the currently active and running thread in
- * order to finish its execution.
+ * order to finish its execution. The return value of the thread is NULL, as
+ * when its function returns.
  */
 void uthread_exit(void);
 
+/*
+ * uthread_exit_retval - Exit from currently running thread with a value
+ * @retval: Return value of the thread, for uthread_join()
+ */
+void uthread_exit_retval(void *retval);
+
+/*
+ * uthread_self - Get the TID of the currently running thread
+ *
+ * Return: TID of the running thread
+ */
+uthread_t uthread_self(void);
+
+/*
+ * uthread_join - Wait for a thread to exit
+ * @tid: TID of the thread to join
+ * @retval: Address where to receive the return value of the thread, or NULL
+ *
+ * The calling thread is blocked until thread @tid exits, unless it already
+ * has. A thread can only be joined once, after which its TID is invalid.
+ *
+ * Return: -1 if @tid is invalid, detached, already being joined, or the TID
+ * of the calling thread, 0 otherwise
+ */
+int uthread_join(uthread_t tid, void **retval);
+
+/*
+ * uthread_detach - Let a thread be deallocated on exit
+ * @tid: TID of the thread to detach
+ *
+ * A detached thread cannot be joined, and is deallocated as soon as it exits
+ * (or right away if it already has). Threads which are never joined should be
+ * detached, as their zombie is otherwise kept until uthread_start() returns.
+ *
+ * Return: -1 if @tid is invalid, already detached or being joined, 0
+ * otherwise
+ */
+int uthread_detach(uthread_t tid);
+
+/*
+ * uthread_tls_alloc - Allocate a thread-local storage slot
+ *
+ * Every thread has its own value in the slot, NULL when the thread is
+ * created. Slots are never released, there are UTHREAD_TLS_SLOTS of them.
+ *
+ * Return: Index of the slot, or -1 if all of them are allocated
+ */
+int uthread_tls_alloc(void);
+
+/*
+ * uthread_tls_get - Get the value of a slot for the running thread
+ * @slot: Index of the slot, as returned by uthread_tls_alloc()
+ *
+ * Return: Value in @slot, or NULL if @slot is invalid
+ */
+void *uthread_tls_get(int slot);
+
+/*
+ * uthread_tls_set - Set the value of a slot for the running thread
+ * @slot: Index of the slot, as returned by uthread_tls_alloc()
+ * @value: Value to store
+ *
+ * Return: -1 if @slot is invalid, 0 otherwise
+ */
+int uthread_tls_set(int slot, void *value);
+
+/*
+ * uthread_set_class - Set the scheduling class of the running thread
+ * @sched_class: UTHREAD_CLASS_INTERACTIVE, UTHREAD_CLASS_BATCH (the class of
+ * the first thread) or UTHREAD_CLASS_BACKGROUND
+ *
+ * A ready thread of a class runs before the ready threads of the lower
+ * classes, which only get an occasional turn while higher classes keep
+ * threads ready. New threads start in the class of their creator.
+ *
+ * Return: 0 in case of success, or -1 if @sched_class is invalid
+ */
+int uthread_set_class(int sched_class);
+
+/*
+ * uthread_set_deadline - Set the deadline of the running thread
+ * @deadline_us: Deadline, in microseconds from now, or 0 for none
+ *
+ * Within a class, the ready threads with a deadline run first, earliest
+ * deadline first, then the others in order. New threads start without a
+ * deadline.
+ */
+void uthread_set_deadline(unsigned long deadline_us);
+
 /*
  * uthread_yield - Yield execution
  *
@@ -64,6 +226,8 @@ void uthread_yield(void);
 
 #ifdef _UTHREAD_PRIVATE
 
+#include <pthread.h>
+
 /*
  * Private uthread API
  *
@@ -89,22 +253,19 @@ struct uthread_tcb *uthread_current(void);
 void uthread_block(void);
 
 /*
- * uthread_unblock - Unblock thread
- * @uthread: TCB of thread to unblock
- */
-void uthread_unblock(struct uthread_tcb *uthread);
-
-/*
- * uthread_get_tls - Get TLS pointer of currently running thread
+ * uthread_block_locked - Block currently running thread, then release a lock
+ * @lock: Lock held by the caller, or NULL
  *
- * Return: Pointer to current thread's TLS
+ * @lock is released once the thread is switched out, so that a thread which
+ * unblocks it under @lock never resumes it before it is fully blocked.
  */
-void *uthread_get_tls(void);
+void uthread_block_locked(pthread_mutex_t *lock);
 
 /*
- * uthread_set_tls - Set TLS pointer for currently running thread
+ * uthread_unblock - Unblock thread
+ * @uthread: TCB of thread to unblock
  */
-void uthread_set_tls(void *tls);
+void uthread_unblock(struct uthread_tcb *uthread);
 
 #endif /* _UTHREAD_PRIVATE */
 
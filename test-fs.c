@@ -1,8 +1,8 @@
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -160,7 +160,7 @@ void thread_fs_rm(void *arg)
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	char *diskname, *filename;
 	int fd, fs_fd;
 	struct stat st;
 	size_t written;
@@ -180,14 +180,10 @@ void thread_fs_add(void *arg)
 	if (!S_ISREG(st.st_mode))
 		die("Not a regular file: %s\n", filename);
 
-	/* Map file into buffer */
-	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (!buf)
-		die_perror("mmap");
-
 	/* Now, deal with our filesystem:
 	 * - mount, create a new file, copy content of host file into this new
-	 *   file, close the new file, and umount
+	 *   file (by the kernel, straight to the virtual disk), close the new
+	 *   file, and umount
 	 */
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
@@ -203,7 +199,7 @@ void thread_fs_add(void *arg)
 		die("Cannot open file");
 	}
 
-	written = fs_write(fs_fd, buf, st.st_size);
+	written = fs_import(fs_fd, fd, st.st_size);
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
@@ -216,10 +212,369 @@ void thread_fs_add(void *arg)
 	printf("Wrote file '%s' (%zu/%zu bytes)\n", filename, written,
 	       st.st_size);
 
-	munmap(buf, st.st_size);
 	close(fd);
 }
 
+/*
+ * Host I/O pipelines: a pthread performs the host side of a transfer, in
+ * chunks going through a small ring of slots, while the uthread performs the
+ * file system side. For bulk imports, the pthread reads the host files ahead
+ * and the uthread drains the slots into the file system. For exports, the
+ * uthread reads the next chunk while the pthread writes the previous one.
+ */
+#define PIPE_ADD_SLOTS	4
+#define PIPE_GET_SLOTS	2
+#define PIPE_MAX_SLOTS	4
+#define PIPE_CHUNK_SIZE	(1 << 20)
+
+struct pipe_slot {
+	int file;		/* Index of the host file in the list */
+	size_t size;		/* Size of the host file, -1 if unreadable */
+	size_t len;		/* Length of the chunk */
+	int is_first;
+	int is_last;
+	char *data;
+};
+
+struct host_pipe {
+	pthread_mutex_t lock;
+	pthread_cond_t not_full;
+	pthread_cond_t not_empty;
+	struct pipe_slot slots[PIPE_MAX_SLOTS];
+	int nslots, head, count;
+	char **files;
+	int nfiles;
+	int host_fd;		/* Export destination */
+	int error;		/* Export failed to write */
+};
+
+/* Allocate the chunk buffers of the @nslots slots of pipeline @p */
+static void pipe_init(struct host_pipe *p, int nslots)
+{
+	int i;
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->not_full, NULL);
+	pthread_cond_init(&p->not_empty, NULL);
+	p->nslots = nslots;
+	p->head = p->count = 0;
+	p->error = 0;
+	for (i = 0; i < nslots; i++) {
+		p->slots[i].data = malloc(PIPE_CHUNK_SIZE);
+		if (!p->slots[i].data)
+			die_perror("malloc");
+	}
+}
+
+static void pipe_destroy(struct host_pipe *p)
+{
+	int i;
+
+	for (i = 0; i < p->nslots; i++)
+		free(p->slots[i].data);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->not_full);
+	pthread_cond_destroy(&p->not_empty);
+}
+
+static struct pipe_slot *pipe_get_free(struct host_pipe *p)
+{
+	struct pipe_slot *slot;
+
+	pthread_mutex_lock(&p->lock);
+	while (p->count == p->nslots)
+		pthread_cond_wait(&p->not_full, &p->lock);
+	slot = &p->slots[(p->head + p->count) % p->nslots];
+	pthread_mutex_unlock(&p->lock);
+	return slot;
+}
+
+static void pipe_put(struct host_pipe *p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->count++;
+	pthread_cond_signal(&p->not_empty);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static struct pipe_slot *pipe_get_full(struct host_pipe *p)
+{
+	struct pipe_slot *slot;
+
+	pthread_mutex_lock(&p->lock);
+	while (p->count == 0)
+		pthread_cond_wait(&p->not_empty, &p->lock);
+	slot = &p->slots[p->head];
+	pthread_mutex_unlock(&p->lock);
+	return slot;
+}
+
+static void pipe_release(struct host_pipe *p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->head = (p->head + 1) % p->nslots;
+	p->count--;
+	pthread_cond_signal(&p->not_full);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* Reader: every host file as a sequence of chunks, in order */
+static void *add_many_reader(void *arg)
+{
+	struct host_pipe *p = arg;
+	struct pipe_slot *slot;
+	struct stat st;
+	ssize_t ret;
+	size_t done;
+	int i, fd, is_last;
+
+	for (i = 0; i < p->nfiles; i++) {
+		fd = open(p->files[i], O_RDONLY);
+		if (fd >= 0 && (fstat(fd, &st) || !S_ISREG(st.st_mode))) {
+			close(fd);
+			fd = -1;
+		}
+
+		done = 0;
+		do {
+			slot = pipe_get_free(p);
+			slot->file = i;
+			slot->size = fd < 0 ? (size_t)-1 : st.st_size;
+			slot->is_first = !done;
+			slot->len = 0;
+			while (fd >= 0 && slot->len < PIPE_CHUNK_SIZE) {
+				ret = read(fd, slot->data + slot->len,
+					   PIPE_CHUNK_SIZE - slot->len);
+				if (ret <= 0)
+					break;
+				slot->len += ret;
+			}
+			done += slot->len;
+			is_last = fd < 0 || slot->len < PIPE_CHUNK_SIZE ||
+				done >= st.st_size;
+			slot->is_last = is_last;
+			pipe_put(p);
+		} while (!is_last);
+
+		if (fd >= 0)
+			close(fd);
+	}
+
+	return NULL;
+}
+
+/* Read the host file names of a list file, one per line */
+static char **read_file_list(const char *listname, int *nfiles)
+{
+	FILE *list;
+	char **files = NULL;
+	char line[4096];
+	int n = 0;
+
+	list = strcmp(listname, "-") ? fopen(listname, "r") : stdin;
+	if (!list)
+		die_perror("fopen");
+
+	while (fgets(line, sizeof(line), list)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (!line[0])
+			continue;
+		files = realloc(files, (n + 1) * sizeof(char *));
+		if (!files)
+			die_perror("realloc");
+		files[n++] = strdup(line);
+	}
+
+	if (list != stdin)
+		fclose(list);
+	*nfiles = n;
+	return files;
+}
+
+void thread_fs_add_many(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct host_pipe p;
+	struct pipe_slot *slot;
+	pthread_t reader;
+	char *diskname, *filename;
+	int fs_fd = -1, failed = 0, done;
+	size_t written = 0;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename>... | -@<list file>");
+
+	diskname = t_arg->argv[0];
+	if (!strncmp(t_arg->argv[1], "-@", 2)) {
+		p.files = read_file_list(t_arg->argv[1] + 2, &p.nfiles);
+	} else {
+		p.files = &t_arg->argv[1];
+		p.nfiles = t_arg->argc - 1;
+	}
+	if (!p.nfiles)
+		return;
+
+	pipe_init(&p, PIPE_ADD_SLOTS);
+
+	/* Mount once: the metadata is written back once, at umount */
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (pthread_create(&reader, NULL, add_many_reader, &p))
+		die("Cannot create reader thread");
+
+	do {
+		slot = pipe_get_full(&p);
+		filename = p.files[slot->file];
+
+		if (slot->is_first) {
+			written = 0;
+			fs_fd = -1;
+			if (slot->size == (size_t)-1)
+				test_fs_error("Cannot read host file '%s'",
+					      filename);
+			else if (fs_create(filename))
+				test_fs_error("Cannot create file '%s'",
+					      filename);
+			else
+				fs_fd = fs_open(filename);
+		}
+
+		if (fs_fd >= 0 && slot->len) {
+			int ret = fs_write(fs_fd, slot->data, slot->len);
+			if (ret > 0)
+				written += ret;
+		}
+
+		if (slot->is_last) {
+			if (fs_fd >= 0) {
+				fs_close(fs_fd);
+				printf("Wrote file '%s' (%zu/%zu bytes)\n",
+				       filename, written, slot->size);
+			} else {
+				failed++;
+			}
+		}
+
+		done = slot->is_last && slot->file == p.nfiles - 1;
+		pipe_release(&p);
+	} while (!done);
+
+	pthread_join(reader, NULL);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	pipe_destroy(&p);
+
+	if (failed)
+		die("%d file(s) could not be added", failed);
+}
+
+/* Writer: every chunk to the host file, in order, until the last one */
+static void *get_writer(void *arg)
+{
+	struct host_pipe *p = arg;
+	struct pipe_slot *slot;
+	size_t done;
+	ssize_t ret;
+	int is_last;
+
+	do {
+		slot = pipe_get_full(p);
+		for (done = 0; !p->error && done < slot->len; done += ret) {
+			ret = write(p->host_fd, slot->data + done,
+				    slot->len - done);
+			if (ret < 0) {
+				perror("write");
+				p->error = 1;
+			}
+		}
+		is_last = slot->is_last;
+		pipe_release(p);
+	} while (!is_last);
+
+	return NULL;
+}
+
+void thread_fs_get(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct host_pipe p;
+	struct pipe_slot *slot;
+	pthread_t writer;
+	char *diskname, *filename, *hostname;
+	int fs_fd, ret, is_last;
+	size_t stat, read = 0;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <filename> <host filename>|-");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	hostname = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+	stat = fs_stat(fs_fd);
+
+	/* Output straight to the file descriptor, in large writes */
+	if (!strcmp(hostname, "-"))
+		p.host_fd = STDOUT_FILENO;
+	else
+		p.host_fd = open(hostname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (p.host_fd < 0) {
+		fs_umount();
+		die_perror("open");
+	}
+
+	/* Double buffering: read a chunk while the previous one is written */
+	pipe_init(&p, PIPE_GET_SLOTS);
+	if (pthread_create(&writer, NULL, get_writer, &p))
+		die("Cannot create writer thread");
+
+	do {
+		slot = pipe_get_free(&p);
+		slot->len = 0;
+		if (!p.error && read < stat) {
+			ret = fs_read(fs_fd, slot->data, PIPE_CHUNK_SIZE);
+			if (ret > 0)
+				slot->len = ret;
+		}
+		read += slot->len;
+		is_last = p.error || slot->len < PIPE_CHUNK_SIZE ||
+			read >= stat;
+		slot->is_last = is_last;
+		pipe_put(&p);
+	} while (!is_last);
+
+	pthread_join(writer, NULL);
+	pipe_destroy(&p);
+	if (p.host_fd != STDOUT_FILENO)
+		close(p.host_fd);
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	if (p.error)
+		die("Cannot write host file");
+
+	/* Keep standard output for the data */
+	fprintf(p.host_fd == STDOUT_FILENO ? stderr : stdout,
+		"Read file '%s' (%zu/%zu bytes)\n", filename, read, stat);
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -265,8 +620,10 @@ static struct {
 	{ "info",	thread_fs_info },
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
+	{ "add-many",	thread_fs_add_many },
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
+	{ "get",	thread_fs_get },
 	{ "stat",	thread_fs_stat },
 };
 